@@ -37,126 +37,281 @@
 #include <errno.h>
 #include <libexif/exif-data.h>
 #include <unistd.h>
+#include <limits.h>
 #include <endian.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <libexif/exif-loader.h>
 
+#include "rpi2dng.h"
+#include "rpiraw.h"
 
-#define RPI_RAW_ID_LEN          4             /* ID length, the an additional "@" not counted */
-#define RPI_RAW_MARKER          "@BRCM"       /* Marker + ID */
-#define RPI_RAW_HDR_LEN         32768         /* RAW header length */
-#define RPI_RAW_BIT_DEPTH       10            /* Always 10-bit packed for now, will need new unpacking procedure when 12-bit present */
-#define RPI_RAW_MAX_MODEL_LEN   9
-
-#define TIFF_CFA_R              0
-#define TIFF_CFA_G              1
-#define TIFF_CFA_B              2
-#define TIFF_CFA_C              3
-#define TIFF_CFA_M              4
-#define TIFF_CFA_Y              5
-#define TIFF_CFA_K              6             /* White (clear) pixel */
-
-#define RPI_RAW_CFA_FLIP_NONE   0x00
-#define RPI_RAW_CFA_FLIP_HORIZ  0x01
-#define RPI_RAW_CFA_FLIP_VERT   0x02
-#define RPI_RAW_CFA_FLIP_BOTH   (RPI_RAW_CFA_FLIP_HORIZ | RPI_RAW_CFA_FLIP_VERT)
-#define RPI_RAW_CFA_PATT_NEW    {TIFF_CFA_G, TIFF_CFA_B, TIFF_CFA_R, TIFF_CFA_G}
-#define RPI_RAW_CFA_PATT_OLD    {TIFF_CFA_B, TIFF_CFA_G, TIFF_CFA_G, TIFF_CFA_R}
-
-#define BLC_OV5647              {16, 16, 16, 16}
-#define BLC_IMX219              {64, 64, 64, 64} /* Nearly universal on SONY CIS */
 
 #define DNG_SOFTWARE_ID         "rpi2dng @dword1511 fork"
 #define DNG_VER                 "\001\001\0\0"
 #define DNG_BACKWARD_VER        "\001\0\0\0"
+#define DNG_VER_OPCODES         "\001\003\0\0"  /* Opcode lists need DNG 1.3 */
+#define DNG_OPCODE_VER          0x01030000
+#define DNG_OPCODE_FLAG_OPTIONAL 0x00000001
+#define DNG_OPCODE_FIXBADPIXELSLIST 5
+
+#define EXIF_TAG_BODY_SERIAL    ((ExifTag)0xa431) /* Not known to older libexif */
+
+#define BPD_THRESHOLD           128           /* Margin against same-colour neighbours, in RAW units */
+#define BPD_BLOCK               16            /* Fixed-size column block, so that the compiler can vectorize the detector */
+#define BPD_MAX_POINTS          4096          /* Frames with more outliers than this are not used (probably not dark enough) */
+#define BPM_MAX_POINTS          65536         /* Bad pixels listed in the DNG at most */
+#define BPM_MAGIC               "RPIBPM\002\0"  /* Version 2 only counts dark frames */
+#define BPM_MAGIC_LEN           8
+#define BPM_MIN_HITS            2             /* A single frame cannot tell a hot pixel from a star */
+#define BPM_MIN_FRAMES          8             /* List nothing before this many dark frames are counted */
+#define BPM_PRUNE_FRAMES        8             /* Start forgetting rare candidates after this many frames */
+#define BPM_DARK_MARGIN         16            /* Frames with mean level above black level + this are scene, not dark frames */
+#define BPM_MAX_SERIAL_LEN      31
+
+#define RPI_MAX_THREADS         16
+#define BANDS_PER_THREAD        4             /* Smaller bands let writing start earlier and even out the load */
+#define MAX_BANDS               (RPI_MAX_THREADS * BANDS_PER_THREAD)
+#define BAND_PENDING            0
+#define BAND_DONE               1
+#define BAND_FAILED             2
+
+#define MAKERNOTE_MAX_FIELDS    32
+#define MAKERNOTE_MAX_VALUE     128
+
+#define MAP_ASCII               0
+#define MAP_SHORT               1
+#define MAP_SHORT_ARRAY         2             /* Written as an array of 1 */
+#define MAP_RATIONAL            3
+#define MAP_SRATIONAL           4
+#define MAP_VERSION             5             /* 4 bytes, e.g. "0100" */
+#define MAP_BLOB                6             /* Any size */
+
+#define SERVER_BACKLOG          16
+#define SERVER_MAX_TOKENS       32
 
 /* NOTE: MIN(a, b) and MAX(a, b) already defined by <libexif/exif-data.h> */
 
 
 typedef struct {
-  uint16_t  width;
-  uint16_t  height;
-  uint16_t  row_len;
-  uint64_t  raw_len;
-
-  char      cfa_pattern[4];
-  float     black_lvl[4];
-  char      model[RPI_RAW_MAX_MODEL_LEN + 1];
-} raw_fmt_t;
-
-
-const raw_fmt_t fmt_ov5647_old = {
-  .width        = 2592,
-  .height       = 1944,
-  .row_len      = 3264,     /* 8-pixel padding + other stuff, 24 bytes total */
-  .raw_len      = 6404096,
-
-  .cfa_pattern  = RPI_RAW_CFA_PATT_OLD,
-  .black_lvl    = BLC_OV5647,
-  .model        = "ov5647",
-};
+  uint32_t  count;
+  uint32_t  size;
+  bool      overflow;
+  uint32_t* index;    /* row * width + col, ascending */
+} bpd_list_t;
 
-const raw_fmt_t fmt_ov5647_new = {
-  .width        = 2592,
-  .height       = 1944,
-  .row_len      = 3264,     /* 8-pixel padding + other stuff, 24 bytes total */
-  .raw_len      = 6404096,
+typedef struct {
+  ExifIfd   ifd;
+  ExifTag   exif_tag;
+  uint32_t  tiff_tag;           /* 0 if only looked up, not copied */
+  uint8_t   type;               /* MAP_* */
+} tag_map_t;
 
-  .cfa_pattern  = RPI_RAW_CFA_PATT_NEW,
-  .black_lvl    = BLC_OV5647,
-  .model        = "RP_ov5647",
-};
+typedef struct {
+  bool      has_matrix;
+  float     matrix[9];          /* Parsed once, as given with -M */
+  int       flip;
+  char*     out;
+  char*     bpm_dir;
+  char*     camera_id;          /* Tells cameras of the same model apart in the cache */
+  int       threads;
+} conv_opts_t;
+
+typedef struct {
+  uint64_t  usec;               /* Conversion time */
+  uint32_t  bad_pixels;         /* Listed in the DNG */
+} conv_stats_t;
 
-const raw_fmt_t fmt_ov5647_new2 = {
-  .width        = 2592,
-  .height       = 1944,
-  .row_len      = 3264,     /* 8-pixel padding + other stuff, 24 bytes total */
-  .raw_len      = 6404096,
+typedef struct {
+  const raw_fmt_t*  fmt;
+  int               fd;         /* Input, read with pread() */
+  uint64_t          offset;     /* Of the first row */
+  uint16_t*         pixel;      /* Whole frame, unpacked */
+  bool              detect;     /* Look for hot/dead pixels */
+  uint32_t          band_rows;
+  uint32_t          bands;
+
+  pthread_mutex_t   lock;
+  pthread_cond_t    cond;       /* Signalled when a band completes */
+  uint32_t          next;       /* Next band to unpack */
+  bool              abort;
+  uint8_t*          state;      /* BAND_* for each band */
+  bpd_list_t*       found;      /* Outliers for each band */
+  uint64_t*         sum;        /* Sum of the pixels of each band, for the frame level */
+} unpack_ctx_t;
 
-  .cfa_pattern  = RPI_RAW_CFA_PATT_NEW,
-  .black_lvl    = BLC_OV5647,
-  .model        = "RP_OV5647",
-};
+typedef struct {
+  struct conv_buf*  buf;
+  int               id;         /* Index of the band buffers of this worker */
+} unpack_arg_t;
+
+/* Kept between files, so that converting another frame neither allocates nor starts threads */
+typedef struct conv_buf {
+  uint16_t*       pixel;        /* Whole frame, unpacked */
+  size_t          pixel_len;
+  unsigned char*  band[RPI_MAX_THREADS];  /* Band of each worker, packed */
+  size_t          band_len[RPI_MAX_THREADS];
+  uint16_t*       halo[RPI_MAX_THREADS];  /* Rows around the band of each worker */
+  size_t          halo_len[RPI_MAX_THREADS];
+  uint8_t         state[MAX_BANDS];
+  bpd_list_t      found[MAX_BANDS];
+  uint64_t        sum[MAX_BANDS];
+
+  /* Band workers, only touch their buffers while a frame is handed out */
+  pthread_mutex_t lock;
+  pthread_cond_t  wake;         /* Signalled when a frame is handed out, or on exit */
+  pthread_cond_t  idle;         /* Signalled when the last worker is done with the frame */
+  pthread_t       tid[RPI_MAX_THREADS];
+  unpack_arg_t    arg[RPI_MAX_THREADS];
+  int             started;
+  unpack_ctx_t*   ctx;          /* Frame being unpacked */
+  uint32_t        frame;        /* Incremented for each frame */
+  int             active;       /* Workers taking part in this frame */
+  int             busy;         /* ... and not done with it yet */
+  bool            quit;
+} conv_buf_t;
+
+typedef struct job {
+  struct job*       next;
+  conv_opts_t       opts;
+  const char*       in;         /* May be NULL if `fd' is given */
+  int               fd;         /* -1 if not passed */
+  int               status;
+  conv_stats_t      stats;
+  uint64_t          queued;     /* Time of submission */
+  uint64_t          wait_usec;  /* Time in queue */
+  bool              done;
+} job_t;
+
+typedef struct {
+  pthread_mutex_t   lock;
+  pthread_cond_t    ready;      /* Signalled when a job is queued */
+  pthread_cond_t    done;       /* Signalled when a job completes */
+  job_t*            head;
+  job_t*            tail;
+  conv_opts_t       defaults;   /* From the command line */
+} server_t;
+
+
+/*
+ * EXIF entries picked up from the JPEG, sorted by IFD then tag (for bsearch).
+ * Entries with a TIFF tag are copied in this order.
+ */
+static const tag_map_t tag_map[] = {
+  /* IFD0 */
+  {EXIF_IFD_0,    EXIF_TAG_MAKE,                TIFFTAG_MAKE,                 MAP_ASCII},
+  {EXIF_IFD_0,    EXIF_TAG_MODEL,               TIFFTAG_MODEL,                MAP_ASCII},
+  /* Skipped: XResolution (72 = Unkown) */
+  /* Skipped: YResolution (72 = Unkown) */
+  /* Skipped: ResolutionUnit */
+  /* Skipped: Modify date */
+  /* Skipped: YCbCrPositioning (for JPEG only) */
+  /* Skipped: ExifOffset */
 
-const raw_fmt_t fmt_imx219 = {
-  .width        = 3280,
-  .height       = 2464,
-  .row_len      = 4128,     /* 16-pixel padding + other stuff, 28 bytes total */
-  .raw_len      = 10270208,
+  /* ExifIFD */
+  {EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_TIME,       EXIFTAG_EXPOSURETIME,         MAP_RATIONAL},
+  {EXIF_IFD_EXIF, EXIF_TAG_FNUMBER,             EXIFTAG_FNUMBER,              MAP_RATIONAL},
+  {EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_PROGRAM,    EXIFTAG_EXPOSUREPROGRAM,      MAP_SHORT},
+  {EXIF_IFD_EXIF, EXIF_TAG_ISO_SPEED_RATINGS,   EXIFTAG_ISOSPEEDRATINGS,      MAP_SHORT_ARRAY},
+  /* Skipped: ExifVersion */
+  {EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_ORIGINAL,  EXIFTAG_DATETIMEORIGINAL,     MAP_ASCII},
+  {EXIF_IFD_EXIF, EXIF_TAG_DATE_TIME_DIGITIZED, EXIFTAG_DATETIMEDIGITIZED,    MAP_ASCII},
+  /* Skipped: ComponentsConfiguration (for JPEG only) */
+  {EXIF_IFD_EXIF, EXIF_TAG_SHUTTER_SPEED_VALUE, EXIFTAG_SHUTTERSPEEDVALUE,    MAP_SRATIONAL},
+  {EXIF_IFD_EXIF, EXIF_TAG_APERTURE_VALUE,      EXIFTAG_APERTUREVALUE,        MAP_RATIONAL},  /* For original lens only */
+  {EXIF_IFD_EXIF, EXIF_TAG_BRIGHTNESS_VALUE,    EXIFTAG_BRIGHTNESSVALUE,      MAP_SRATIONAL},
+  {EXIF_IFD_EXIF, EXIF_TAG_MAX_APERTURE_VALUE,  EXIFTAG_MAXAPERTUREVALUE,     MAP_RATIONAL},  /* For original lens only */
+  {EXIF_IFD_EXIF, EXIF_TAG_METERING_MODE,       EXIFTAG_METERINGMODE,         MAP_SHORT},
+  {EXIF_IFD_EXIF, EXIF_TAG_FLASH,               EXIFTAG_FLASH,                MAP_SHORT},
+  {EXIF_IFD_EXIF, EXIF_TAG_FOCAL_LENGTH,        EXIFTAG_FOCALLENGTH,          MAP_RATIONAL},  /* For original lens only */
+  {EXIF_IFD_EXIF, EXIF_TAG_MAKER_NOTE,          EXIFTAG_MAKERNOTE,            MAP_BLOB},      /* Also parsed, see parse_makernote() */
+  {EXIF_IFD_EXIF, EXIF_TAG_FLASH_PIX_VERSION,   EXIFTAG_FLASHPIXVERSION,      MAP_VERSION},
+  /* Skipped: ColorSpace (for JPEG only) */
+  /* Skipped: ExifImageWidth (for JPEG only) */
+  /* Skipped: ExifImageHeight (for JPEG only) */
+  /* Skipped: InteropOffset */
+  {EXIF_IFD_EXIF, EXIF_TAG_EXPOSURE_MODE,       EXIFTAG_EXPOSUREMODE,         MAP_SHORT},
+  {EXIF_IFD_EXIF, EXIF_TAG_WHITE_BALANCE,       EXIFTAG_WHITEBALANCE,         MAP_SHORT},
+  {EXIF_IFD_EXIF, EXIF_TAG_BODY_SERIAL,         0,                            MAP_ASCII},     /* For the bad pixel cache */
 
-  .cfa_pattern  = RPI_RAW_CFA_PATT_OLD,
-  .black_lvl    = BLC_IMX219,
-  .model        = "RP_imx219",
+  /* InteropIFD */
+  /* Skipped: InteropIndex */
+  /* IFD1 (Thumbnail data) */
 };
 
-const raw_fmt_t *const supported_formats[] = {
-  &fmt_ov5647_old,
-  &fmt_ov5647_new,
-  &fmt_ov5647_new2,
-  &fmt_imx219,
-  NULL
+#define TAG_MAP_LEN             (sizeof(tag_map) / sizeof(tag_map[0]))
+
+/* EXIF format of each MAP_* */
+static const ExifFormat map_format[] = {
+  [MAP_ASCII]       = EXIF_FORMAT_ASCII,
+  [MAP_SHORT]       = EXIF_FORMAT_SHORT,
+  [MAP_SHORT_ARRAY] = EXIF_FORMAT_SHORT,
+  [MAP_RATIONAL]    = EXIF_FORMAT_RATIONAL,
+  [MAP_SRATIONAL]   = EXIF_FORMAT_SRATIONAL,
+  [MAP_VERSION]     = EXIF_FORMAT_UNDEFINED,
+  [MAP_BLOB]        = EXIF_FORMAT_UNDEFINED,
 };
 
+static pthread_once_t tag_map_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+  ExifByteOrder     order;
+  ExifIfd           walking;    /* IFD being walked */
+  const ExifEntry*  entry[TAG_MAP_LEN];   /* By index into `tag_map', NULL if absent */
+} exif_tags_t;
+
+typedef struct {
+  unsigned  count;
+  struct {
+    const char* key;
+    size_t      key_len;
+    const char* val;
+    size_t      val_len;
+  } field[MAKERNOTE_MAX_FIELDS];
+} makernote_t;
+
 
 static void usage(const char* self) {
-  fprintf (stderr, "Usage: %s [options] infile1.jpg [infile2.jpg ...]\n\n"
+  fprintf (stderr, "Usage: %s [options] infile1.jpg [infile2.jpg ...]\n"
+                   "       %s [options] -S socket [-W workers]\n\n"
     "Options:\n"
       "\t-H          Assume horizontal flip (option -HF of raspistill)\n"
       "\t-V          Assume vertical flip (option -VF of raspistill)\n"
       "\t-o outfile  Create `outfile' instead of infile with dng-extension (unless multiple file supplied)\n"
-      "\t-M matrix   Use given color matrix instead of embedded one for conversion\n",
-    self);
+      "\t-M matrix   Use given color matrix instead of embedded one for conversion\n"
+      "\t-B cachedir Detect hot/dead pixels, accumulate them in a per-camera cache and\n"
+      "\t            list the ones seen in most frames as DNG FixBadPixelsList opcode\n"
+      "\t-C id       Camera ID for the cache (default: serial number from EXIF, which Raspberry\n"
+      "\t            Pi cameras do not report, so all cameras of a model share one cache)\n"
+      "\t-j threads  Unpack each file on this many threads (default: number of CPUs)\n"
+      "\t-S socket   Serve conversion requests on this Unix domain socket (see rpi2dngc),\n"
+      "\t            the options above being defaults for each request\n"
+      "\t-W workers  Convert this many requests at a time (default: 1)\n",
+    self, self);
   exit(EXIT_FAILURE);
 }
 
-static void read_matrix(float* matrix, const char* arg) {
+/* Returns the number of entries parsed, `matrix' is only changed if all 9 are */
+static int read_matrix(float* matrix, const char* arg) {
+  float parsed[9];
   float mmax = 0;
-  int   i;
-
-  sscanf(arg, "%f, %f, %f, "
-              "%f, %f, %f, "
-              "%f, %f, %f, ",
-        &matrix[0], &matrix[1], &matrix[2],
-        &matrix[3], &matrix[4], &matrix[5],
-        &matrix[6], &matrix[7], &matrix[8]);
+  int   i, n;
+
+  n = sscanf(arg, "%f, %f, %f, "
+                  "%f, %f, %f, "
+                  "%f, %f, %f, ",
+        &parsed[0], &parsed[1], &parsed[2],
+        &parsed[3], &parsed[4], &parsed[5],
+        &parsed[6], &parsed[7], &parsed[8]);
+  if (9 != n) {
+    return n;
+  }
+  memcpy(matrix, parsed, sizeof(parsed));
 
   /* scale result if input is not normalized */
   for (i = 0; i < 9; i ++) {
@@ -167,18 +322,8 @@ static void read_matrix(float* matrix, const char* arg) {
       matrix[i] /= mmax;
     }
   }
-}
 
-static double rational_to_float(void* p) {
-  uint32_t* r;
-  r = (uint32_t*)p;
-  return be32toh(r[0]) * 1.0 / be32toh(r[1]);
-}
-
-static double srational_to_float(void* p) {
-  int32_t* r;
-  r = (int32_t*)p;
-  return be32toh(r[0]) * 1.0 / be32toh(r[1]);
+  return n;
 }
 
 static void print_matrix(float matrix[9]) {
@@ -191,40 +336,189 @@ static void print_matrix(float matrix[9]) {
         matrix[6], matrix[7], matrix[8]);
 }
 
-static int copy_tags(const ExifData* edata, TIFF* tif, const char* matrix, const char* filename, const raw_fmt_t* fmt, int pattern) {
-  const long  white     = (1 << RPI_RAW_BIT_DEPTH) - 1;
-  const short cfadim[]  = {2, 2}; /* libtiff5 only supports 2x2 CFA */
-  ExifEntry*  eentry    = NULL;
-  char        cfapatt[] = {TIFF_CFA_K, TIFF_CFA_K, TIFF_CFA_K, TIFF_CFA_K};
-  struct tm*  tm        = NULL;
-  time_t      rawtime;
-  char        datetime[64];
-  float       gain[]    = {1.0, 1.0, 1.0}; /* Default */
-  float       neutral[3];
-  uint64_t    exif_dir_offset = 0;
-  //unsigned short curve[256];
-  /* Default color matrix from dcraw */
-  float cam_xyz[]  = {
-    /*  R        G        B         */
-     1.2782, -0.4059, -0.0379, /* R */
-    -0.0478,  0.9066,  0.1413, /* G */
-     0.1340,  0.1513,  0.5176  /* B */
-  };
+static int tag_map_cmp(const void* a, const void* b) {
+  const tag_map_t* x = (const tag_map_t*) a;
+  const tag_map_t* y = (const tag_map_t*) b;
 
-  /* ExifData, TIFF context, Color matrix buffer and Sub-IFD offset buffer are required. */
-  /* Color matrix preset and Original file name are optional. */
-  if ((NULL == edata) || (NULL == tif)) {
-    fprintf(stderr, "Internal error!\n");
-    abort();
+  if (x->ifd != y->ifd) {
+    return (x->ifd < y->ifd) ? -1 : 1;
   }
+  return (x->exif_tag < y->exif_tag) ? -1 : (x->exif_tag > y->exif_tag);
+}
 
-  /* New and old formats have different CFA arrangements */
-  eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_0], EXIF_TAG_MODEL);
-  if (NULL == eentry) {
-    fprintf(stderr, "EXIF IFD0 does not contain MODEL tag!");
-    return EXIT_FAILURE;
+static const tag_map_t* tag_map_find(ExifIfd ifd, ExifTag tag) {
+  const tag_map_t key = {.ifd = ifd, .exif_tag = tag};
+
+  return (const tag_map_t*) bsearch(&key, tag_map, TAG_MAP_LEN, sizeof(tag_map[0]), tag_map_cmp);
+}
+
+/* Lookups rely on `tag_map' being sorted, make sure additions keep it that way */
+static void check_tag_map(void) {
+  unsigned i;
+
+  for (i = 1; i < TAG_MAP_LEN; i ++) {
+    if (tag_map_cmp(&tag_map[i - 1], &tag_map[i]) >= 0) {
+      fprintf(stderr, "Internal error: tag_map[%u] out of order!\n", i);
+      abort();
+    }
+  }
+}
+
+/* Entries of an unexpected format are ignored, so readers only need to check the size */
+static void collect_entry(ExifEntry* eentry, void* user) {
+  exif_tags_t*      tags  = (exif_tags_t*) user;
+  const tag_map_t*  map   = tag_map_find(tags->walking, eentry->tag);
+
+  if ((NULL != map) && (NULL != eentry->data) && (eentry->format == map_format[map->type]) && (eentry->components > 0)) {
+    tags->entry[map - tag_map] = eentry;
+  }
+}
+
+/* One walk over each IFD of interest picks up all entries in `tag_map' */
+static void collect_tags(ExifData* edata, exif_tags_t* tags) {
+  const ExifIfd ifds[] = {EXIF_IFD_0, EXIF_IFD_EXIF};
+  unsigned      i;
+
+  pthread_once(&tag_map_once, check_tag_map);
+
+  memset(tags, 0, sizeof(*tags));
+  tags->order = exif_data_get_byte_order(edata);
+
+  for (i = 0; i < sizeof(ifds) / sizeof(ifds[0]); i ++) {
+    if (NULL != edata->ifd[ifds[i]]) {
+      tags->walking = ifds[i];
+      exif_content_foreach_entry(edata->ifd[ifds[i]], collect_entry, tags);
+    }
+  }
+}
+
+static const ExifEntry* get_tag(const exif_tags_t* tags, ExifIfd ifd, ExifTag tag) {
+  const tag_map_t* map = tag_map_find(ifd, tag);
+
+  return (NULL == map) ? NULL : tags->entry[map - tag_map];
+}
+
+/* Copy collected entries of `ifd' into the current TIFF directory */
+static void set_tags(TIFF* tif, const exif_tags_t* tags, ExifIfd ifd) {
+  const ExifEntry*  eentry;
+  unsigned          i;
+
+  for (i = 0; i < TAG_MAP_LEN; i ++) {
+    if ((tag_map[i].ifd != ifd) || (0 == tag_map[i].tiff_tag) || (NULL == (eentry = tags->entry[i]))) {
+      continue;
+    }
+
+    /* Format and component count were checked by collect_entry(), sizes are checked here */
+    switch (tag_map[i].type) {
+      case MAP_ASCII: {
+        if ((0 < eentry->size) && (NULL != memchr(eentry->data, '\0', eentry->size))) {
+          TIFFSetField(tif, tag_map[i].tiff_tag, eentry->data);
+        }
+        break;
+      }
+      case MAP_SHORT: {
+        if (eentry->size >= 2) {
+          TIFFSetField(tif, tag_map[i].tiff_tag, exif_get_short(eentry->data, tags->order));
+        }
+        break;
+      }
+      case MAP_SHORT_ARRAY: {
+        if (eentry->size >= 2) {
+          uint16_t v = exif_get_short(eentry->data, tags->order); /* First one only */
+          TIFFSetField(tif, tag_map[i].tiff_tag, 1, &v);
+        }
+        break;
+      }
+      case MAP_RATIONAL: {
+        if (eentry->size >= 8) {
+          ExifRational r = exif_get_rational(eentry->data, tags->order);
+          if (0 != r.denominator) {
+            TIFFSetField(tif, tag_map[i].tiff_tag, r.numerator * 1.0 / r.denominator);
+          }
+        }
+        break;
+      }
+      case MAP_SRATIONAL: {
+        if (eentry->size >= 8) {
+          ExifSRational r = exif_get_srational(eentry->data, tags->order);
+          if (0 != r.denominator) {
+            TIFFSetField(tif, tag_map[i].tiff_tag, r.numerator * 1.0 / r.denominator);
+          }
+        }
+        break;
+      }
+      case MAP_VERSION: {
+        if (eentry->size >= 4) {
+          TIFFSetField(tif, tag_map[i].tiff_tag, eentry->data);
+        }
+        break;
+      }
+      case MAP_BLOB: {
+        TIFFSetField(tif, tag_map[i].tiff_tag, eentry->size, eentry->data);
+        break;
+      }
+      default: {
+        fprintf(stderr, "Internal error!\n");
+        abort();
+      }
+    }
   }
+}
+
+/*
+ * Split the MakerNote into `key=value' fields in one pass. Pi camera MakerNotes
+ * look like "ev=-1 mlux=-1 exp=10000 ag=256 ... gain_r=1.234 ccm=...". Fields
+ * point into the entry, values are not NUL-terminated.
+ */
+static void parse_makernote(const ExifEntry* eentry, makernote_t* mn) {
+  const char* p   = (const char*) eentry->data;
+  const char* end = p + eentry->size;
+  const char* token;
+  const char* eq;
+
+  mn->count = 0;
+  while ((p < end) && ('\0' != *p) && (mn->count < MAKERNOTE_MAX_FIELDS)) {
+    if (' ' == *p) {
+      p ++;
+      continue;
+    }
+
+    for (token = p, eq = NULL; (p < end) && (' ' != *p) && ('\0' != *p); p ++) {
+      if ((NULL == eq) && ('=' == *p)) {
+        eq = p;
+      }
+    }
+
+    if ((NULL != eq) && (eq > token)) {
+      mn->field[mn->count].key      = token;
+      mn->field[mn->count].key_len  = eq - token;
+      mn->field[mn->count].val      = eq + 1;
+      mn->field[mn->count].val_len  = p - (eq + 1);
+      mn->count ++;
+    }
+  }
+}
+
+/* Copy value of `key' to `val' as a string, false if not found (or too long) */
+static bool makernote_get(const makernote_t* mn, const char* key, char* val, size_t len) {
+  const size_t  key_len = strlen(key);
+  unsigned      i;
+
+  for (i = 0; i < mn->count; i ++) {
+    if ((mn->field[i].key_len == key_len) && (0 == memcmp(mn->field[i].key, key, key_len))) {
+      if (mn->field[i].val_len >= len) {
+        return false;
+      }
+      memcpy(val, mn->field[i].val, mn->field[i].val_len);
+      val[mn->field[i].val_len] = '\0';
+      return true;
+    }
+  }
+
+  return false;
+}
 
+static void get_cfa_pattern(const raw_fmt_t* fmt, int pattern, char cfapatt[4]) {
   switch (pattern) {
     case RPI_RAW_CFA_FLIP_NONE: {
       cfapatt[0] = fmt->cfa_pattern[0];
@@ -259,39 +553,74 @@ static int copy_tags(const ExifData* edata, TIFF* tif, const char* matrix, const
       abort();
     }
   }
+}
+
+static int copy_tags(const exif_tags_t* tags, TIFF* tif, const float* matrix, const char* filename, const raw_fmt_t* fmt, int pattern) {
+  const long  white     = (1 << RPI_RAW_BIT_DEPTH) - 1;
+  const short cfadim[]  = {2, 2}; /* libtiff5 only supports 2x2 CFA */
+  const ExifEntry* eentry = NULL;
+  makernote_t mn;
+  char        value[MAKERNOTE_MAX_VALUE];
+  char        cfapatt[] = {TIFF_CFA_K, TIFF_CFA_K, TIFF_CFA_K, TIFF_CFA_K};
+  struct tm   tm;
+  time_t      rawtime;
+  char        datetime[64];
+  float       gain[]    = {1.0, 1.0, 1.0}; /* Default */
+  float       neutral[3];
+  uint64_t    exif_dir_offset = 0;
+  int         i;
+  //unsigned short curve[256];
+  /* Default color matrix from dcraw */
+  float cam_xyz[]  = {
+    /*  R        G        B         */
+     1.2782, -0.4059, -0.0379, /* R */
+    -0.0478,  0.9066,  0.1413, /* G */
+     0.1340,  0.1513,  0.5176  /* B */
+  };
+
+  /* EXIF tags and TIFF context are required. */
+  /* Color matrix preset and Original file name are optional. */
+  if ((NULL == tags) || (NULL == tif)) {
+    fprintf(stderr, "Internal error!\n");
+    abort();
+  }
+
+  /* New and old formats have different CFA arrangements */
+  get_cfa_pattern(fmt, pattern, cfapatt);
 
   /* Load color matrix and white balance */
-  if (NULL != matrix) {
-    read_matrix(cam_xyz, matrix);
+  mn.count = 0;
+  if (NULL != (eentry = get_tag(tags, EXIF_IFD_EXIF, EXIF_TAG_MAKER_NOTE))) {
+    parse_makernote(eentry, &mn);
   } else {
-    if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_MAKER_NOTE))) {
-      read_matrix(cam_xyz, strstr((const char *)eentry->data, "ccm=") + 4);
-      sscanf(strstr((const char *)eentry->data, "gain_r=") + 7, "%f", &gain[0]);
-      sscanf(strstr((const char *)eentry->data, "gain_b=") + 7, "%f", &gain[2]);
-
-      neutral[0] = (1 / gain[0]) / ((1 / gain[0]) + (1 / gain[1]) + (1 / gain[2]));
-      neutral[1] = (1 / gain[1]) / ((1 / gain[0]) + (1 / gain[1]) + (1 / gain[2]));
-      neutral[2] = (1 / gain[2]) / ((1 / gain[0]) + (1 / gain[1]) + (1 / gain[2]));
-    } else {
-      fprintf(stderr, "JPEG does not contain MakerNotes! Will use default color matrix.\n");
+    fprintf(stderr, "JPEG does not contain MakerNotes! Will use default color matrix and white balance.\n");
+  }
+  if (NULL != matrix) {
+    memcpy(cam_xyz, matrix, sizeof(cam_xyz));
+  } else if (makernote_get(&mn, "ccm", value, sizeof(value)) && (9 == read_matrix(cam_xyz, value))) {
+    /* Loaded */
+  } else if (NULL != eentry) {
+    fprintf(stderr, "MakerNotes do not contain a valid color matrix! Will use default one.\n");
+  }
+  if (makernote_get(&mn, "gain_r", value, sizeof(value))) {
+    gain[0] = strtof(value, NULL);
+  }
+  if (makernote_get(&mn, "gain_b", value, sizeof(value))) {
+    gain[2] = strtof(value, NULL);
+  }
+  for (i = 0; i < 3; i ++) {
+    if (!(gain[i] > 0)) {
+      gain[i] = 1.0;
     }
   }
+  neutral[0] = (1 / gain[0]) / ((1 / gain[0]) + (1 / gain[1]) + (1 / gain[2]));
+  neutral[1] = (1 / gain[1]) / ((1 / gain[0]) + (1 / gain[1]) + (1 / gain[2]));
+  neutral[2] = (1 / gain[2]) / ((1 / gain[0]) + (1 / gain[1]) + (1 / gain[2]));
   print_matrix(cam_xyz);
 
   /* Write TIFF tags for DNG */
   /* IFD0 */
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_0], EXIF_TAG_MAKE))) {
-    TIFFSetField(tif, TIFFTAG_MAKE, eentry->data);
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_0], EXIF_TAG_MODEL))) {
-    TIFFSetField(tif, TIFFTAG_MODEL, eentry->data);
-  }
-  /* Skipped: XResolution (72 = Unkown) */
-  /* Skipped: YResolution (72 = Unkown) */
-  /* Skipped: ResolutionUnit */
-  /* Skipped: Modify date */
-  /* Skipped: YCbCrPositioning (for JPEG only) */
-  /* Skipped: ExifOffset */
+  set_tags(tif, tags, EXIF_IFD_0);
   /* Addons for DNG */
   TIFFSetField(tif, TIFFTAG_ORIENTATION           , ORIENTATION_TOPLEFT);
   TIFFSetField(tif, TIFFTAG_SOFTWARE              , DNG_SOFTWARE_ID);
@@ -322,8 +651,8 @@ static int copy_tags(const ExifData* edata, TIFF* tif, const char* matrix, const
     TIFFSetField(tif, TIFFTAG_ORIGINALRAWFILENAME, strlen(filename), filename);
   }
   time(&rawtime);
-  tm = localtime(&rawtime);
-  snprintf(datetime, 64, "%04d:%02d:%02d %02d:%02d:%02d", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+  localtime_r(&rawtime, &tm); /* Server workers convert concurrently */
+  snprintf(datetime, 64, "%04d:%02d:%02d %02d:%02d:%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
   TIFFSetField(tif, TIFFTAG_DATETIME, datetime); /* Creation time (for DNG) */
 
   /* Save IFD0 continue */
@@ -332,79 +661,16 @@ static int copy_tags(const ExifData* edata, TIFF* tif, const char* matrix, const
   TIFFSetDirectory(tif, 0);
 
   /* Copy EXIF information */
-  /* TODO: write a macro for these... */
   /* ExifIFD */
   if (EXIT_SUCCESS != TIFFCreateEXIFDirectory(tif)) {
     fprintf(stderr, "Failed to create EXIF directory!\n");
     return EXIT_FAILURE;
   }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_EXPOSURE_TIME))) {
-    TIFFSetField(tif, EXIFTAG_EXPOSURETIME, rational_to_float(eentry->data));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_FNUMBER))) {
-    TIFFSetField(tif, EXIFTAG_FNUMBER, rational_to_float(eentry->data));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_EXPOSURE_PROGRAM))) {
-    TIFFSetField(tif, EXIFTAG_EXPOSUREPROGRAM, be16toh(*((uint16_t *)eentry->data)));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_ISO_SPEED_RATINGS))) {
-    uint16_t iso = be16toh(*((uint16_t *)eentry->data));
-    TIFFSetField(tif, EXIFTAG_ISOSPEEDRATINGS, 1, &iso);
-  }
-  /* Skipped: ExifVersion */
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_DATE_TIME_ORIGINAL))) {
-    TIFFSetField(tif, EXIFTAG_DATETIMEORIGINAL, eentry->data);
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_DATE_TIME_DIGITIZED))) {
-    TIFFSetField(tif, EXIFTAG_DATETIMEDIGITIZED, eentry->data);
-  }
-  /* Skipped: ComponentsConfiguration (for JPEG only) */
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_SHUTTER_SPEED_VALUE))) {
-    TIFFSetField(tif, EXIFTAG_SHUTTERSPEEDVALUE, srational_to_float(eentry->data));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_APERTURE_VALUE))) {
-    /* For original lens only */
-    TIFFSetField(tif, EXIFTAG_APERTUREVALUE, rational_to_float(eentry->data));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_BRIGHTNESS_VALUE))) {
-    TIFFSetField(tif, EXIFTAG_BRIGHTNESSVALUE, srational_to_float(eentry->data));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_MAX_APERTURE_VALUE))) {
-    /* For original lens only */
-    TIFFSetField(tif, EXIFTAG_MAXAPERTUREVALUE, rational_to_float(eentry->data));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_METERING_MODE))) {
-    TIFFSetField(tif, EXIFTAG_METERINGMODE, be16toh(*((uint16_t *)eentry->data)));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_FLASH))) {
-    TIFFSetField(tif, EXIFTAG_FLASH, be16toh(*((uint16_t *)eentry->data)));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_FOCAL_LENGTH))) {
-    /* For original lens only */
-    TIFFSetField(tif, EXIFTAG_FOCALLENGTH, rational_to_float(eentry->data));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_MAKER_NOTE))) {
-    TIFFSetField(tif, EXIFTAG_MAKERNOTE, eentry->size, eentry->data);
-    /* Various information can be extracted from the maker note. */
-    /* Already handled: exp (ExposureTime), ccm (ColorMatrix) */
-    /* ag, gain_r, gain_b, greenness, tg, f ar changing. */
-    /* Additional: ISP version */
-    //sscanf(strstr((const char *)eentry->data, "ev=") + 3, "%f", &ev);
-    //TIFFSetField(tif, EXIFTAG_EXPOSUREBIASVALUE, ev);
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_FLASH_PIX_VERSION))) {
-    TIFFSetField(tif, EXIFTAG_FLASHPIXVERSION, eentry->data);
-  }
-  /* Skipped: ColorSpace (for JPEG only) */
-  /* Skipped: ExifImageWidth (for JPEG only) */
-  /* Skipped: ExifImageHeight (for JPEG only) */
-  /* Skipped: InteropOffset */
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_EXPOSURE_MODE))) {
-    TIFFSetField(tif, EXIFTAG_EXPOSUREMODE, be16toh(*((uint16_t *)eentry->data)));
-  }
-  if (NULL != (eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_EXIF], EXIF_TAG_WHITE_BALANCE))) {
-    TIFFSetField(tif, EXIFTAG_WHITEBALANCE, be16toh(*((uint16_t *)eentry->data)));
-  }
+  set_tags(tif, tags, EXIF_IFD_EXIF);
+  /* Various information can be extracted from the maker note, see makernote_get(). */
+  /* Already handled: exp (ExposureTime), ccm (ColorMatrix), gain_r & gain_b (AsShotNeutral) */
+  /* ag, gain_r, gain_b, greenness, tg, f ar changing. */
+  /* Additional: ISP version */
 
   /* Patch EXIF IFD in */
   TIFFWriteCustomDirectory(tif, &exif_dir_offset);
@@ -412,23 +678,19 @@ static int copy_tags(const ExifData* edata, TIFF* tif, const char* matrix, const
   TIFFSetField(tif, TIFFTAG_EXIFIFD, exif_dir_offset);
   TIFFCheckpointDirectory(tif);
 
-  /* InteropIFD */
-  /* Skipped: InteropIndex */
-  /* IFD1 (Thumbnail data) */
-
   return EXIT_SUCCESS;
 }
 
-static const raw_fmt_t* get_format(ExifData* edata) {
+static const raw_fmt_t* get_format(const exif_tags_t* tags) {
   const ExifEntry*          eentry  = NULL;
   const raw_fmt_t *const *  p_fmt   = supported_formats;
 
-  if (NULL == edata) {
+  if (NULL == tags) {
     fprintf(stderr, "Internal error!\n");
     abort();
   }
 
-  eentry = exif_content_get_entry(edata->ifd[EXIF_IFD_0], EXIF_TAG_MODEL);
+  eentry = get_tag(tags, EXIF_IFD_0, EXIF_TAG_MODEL);
   if (NULL == eentry) {
     fprintf(stderr, "EXIF IFD0 does not contain MODEL tag!\n");
     return NULL;
@@ -450,224 +712,1179 @@ static const raw_fmt_t* get_format(ExifData* edata) {
 }
 
 static uint64_t get_data_offset(FILE* ifp, const raw_fmt_t* fmt) {
-  uint64_t  offset, len;
-  uint8_t   buffer[16];
-
-  /* Check file length */
-  fseek(ifp, 0, SEEK_END);
-  len = ftell(ifp);
-  if (len <= (fmt->raw_len + 1 + 2)) {
-    fprintf(stderr, "File too short to contain expected %" PRIu64 "-byte RAW data.\n", fmt->raw_len);
-    return 0;
-  }
+  uint64_t marker = rpiraw_find_payload(ifp, fmt, true);
 
-  offset = (len - (fmt->raw_len + 1));
-  fseek(ifp, offset - 2, SEEK_SET);
-  fread(buffer, 16, 1, ifp);
-  if ((buffer[0] != 0xff) || (buffer[1] != 0xd9)) {
-    fprintf(stderr, "JPEG EOI not found (want 0xffd9, got 0x%02x%02x, offset %" PRIu64 ").\n", buffer[0], buffer[1], offset);
-    return 0;
-  }
-  if (0 != strncmp((const char*)(buffer + 2), RPI_RAW_MARKER, strlen(RPI_RAW_MARKER))) {
-    fprintf(stderr, "RAW marker not found.\n");
+  if (0 == marker) {
     return 0;
   }
 
-  return (len - fmt->raw_len) + RPI_RAW_HDR_LEN;
+  /* Skip "@" and header */
+  return marker + 1 + RPI_RAW_HDR_LEN;
 }
 
-static void process_file(char* inFile, char* outFile, char* matrix, int pattern) {
-  uint64_t          row, offset;
-
-  char*             dngFile = NULL;
-  unsigned char*    buffer  = NULL; /* Row buffer, packed */
-  uint16_t*         pixel   = NULL; /* Row buffer, unpacked */
-  FILE*             ifp     = NULL;
-  TIFF*             tif     = NULL;
-  ExifData*         edata   = NULL;
-  const raw_fmt_t*  fmt     = NULL;
+static void bpd_add(bpd_list_t* list, uint32_t index, uint32_t max) {
+  uint32_t* p;
 
-  /* Check file existence */
-  if (NULL == (ifp = fopen(inFile, "rb"))) {
-    perror(inFile);
-    goto fail;
+  if (list->overflow) {
+    return;
   }
 
-  /* Load and check EXIF-data */
-  if (NULL == (edata = exif_data_new_from_file(inFile))) {
-    fprintf(stderr, "No EXIF data found, hence no RAW data.\n");
-    goto fail;
+  if (list->count == list->size) {
+    if (list->size >= max) {
+      list->overflow = true;
+      return;
+    }
+    list->size = (0 == list->size) ? 64 : list->size * 2;
+    if (NULL == (p = (uint32_t*) realloc(list->index, list->size * sizeof(list->index[0])))) {
+      list->overflow = true;
+      return;
+    }
+    list->index = p;
   }
 
-  /* Determine format */
-  if (NULL == (fmt = get_format(edata))) {
-    fprintf(stderr, "File format unsupported.\n");
-    goto fail;
-  }
+  list->index[list->count ++] = index;
+}
 
-  /* Location in file the raw pixel data starts */
-  offset = get_data_offset(ifp, fmt);
-  if (0 == offset) {
-    fprintf(stderr, "Cannot determine RAW data offset.\n");
-    goto fail;
+static void bpd_free(bpd_list_t* list) {
+  if (NULL != list->index) {
+    free(list->index);
   }
-  fprintf(stderr, "Found RAW data @ offset %" PRIu64 ".\n", offset);
-  fseek(ifp, offset, SEEK_SET);
+  memset(list, 0, sizeof(*list));
+}
 
-  /* Allocate memory for one line of pixel data */
-  buffer = (unsigned char*) malloc(fmt->row_len + 1);
-  pixel  = (uint16_t*) malloc(fmt->width * fmt->height * sizeof(pixel[0]));
-  if ((NULL == buffer) || (pixel == NULL)) {
-    fprintf(stderr, "Cannot allocate memory for image data!\n");
-    goto fail;
-  }
+static inline uint8_t bpd_test(const uint16_t* up, const uint16_t* cur, const uint16_t* down, unsigned c) {
+  /* Same-colour neighbours are 2 pixels away in a Bayer mosaic */
+  const unsigned hi = MAX(MAX(MAX(up[c - 2], up[c]), MAX(up[c + 2], cur[c - 2])),
+                          MAX(MAX(cur[c + 2], down[c - 2]), MAX(down[c], down[c + 2])));
+  const unsigned lo = MIN(MIN(MIN(up[c - 2], up[c]), MIN(up[c + 2], cur[c - 2])),
+                          MIN(MIN(cur[c + 2], down[c - 2]), MIN(down[c], down[c + 2])));
 
-  /* Generate DNG file name */
-  if (NULL == outFile) {
-    dngFile = strdup(inFile);
-    strcpy(dngFile + strlen(dngFile) - 3, "dng"); /* TODO: ad-hoc, fix this */
-  } else {
-    dngFile = strdup(outFile);
-  }
+  return ((unsigned)cur[c] > hi + BPD_THRESHOLD) | ((unsigned)cur[c] + BPD_THRESHOLD < lo);
+}
 
-  /* Create output TIFF file */
-  if (NULL == (tif = TIFFOpen(dngFile, "w"))) {
-    fprintf(stderr, "Cannot create/open output file `%s'.\n", dngFile);
-    goto fail;
-  }
-  fprintf(stderr, "Creating %s...\n", dngFile);
+/* Scan row `cur' for hot/dead pixels, `up' and `down' being the rows 2 above and below. */
+/* The 2-pixel border is not scanned. */
+static void bpd_scan_row(const uint16_t* up, const uint16_t* cur, const uint16_t* down, uint16_t width, uint32_t base, bpd_list_t* list) {
+  uint8_t   flag[BPD_BLOCK];
+  uint8_t   any;
+  unsigned  col, k;
+
+  /* Branch-free on fixed-size blocks, hits are rare */
+  for (col = 2; col + BPD_BLOCK + 2 <= width; col += BPD_BLOCK) {
+    any = 0;
+    for (k = 0; k < BPD_BLOCK; k ++) {
+      flag[k] = bpd_test(up, cur, down, col + k);
+      any    |= flag[k];
+    }
 
-  /* Copy metadata */
-  if (EXIT_SUCCESS != copy_tags(edata, tif, matrix, inFile, fmt, pattern)) {
-    goto fail;
+    if (any) {
+      for (k = 0; k < BPD_BLOCK; k ++) {
+        if (flag[k]) {
+          bpd_add(list, base + col + k, BPD_MAX_POINTS);
+        }
+      }
+    }
   }
 
-  /* Unpack and copy RAW data */
-  fprintf(stderr, "Extracting RAW data...\n");
-  for (row = 0; row < fmt->height; row ++) {
-    int j, col;
-    fread(buffer, fmt->row_len, 1, ifp); /* Read next line of pixel data */
-    j = 0; /* Offset into buffer */
-
-    /* Iterate over pixel columns (4 pixel per 5 bytes) */
-    for (col = 0; col < fmt->width; col += 4) {
-      unsigned char     split; /* 5th byte, contains 4 pairs of low-order bits */
-
-      pixel[col + 0]  = buffer[j ++] << 8;
-      pixel[col + 1]  = buffer[j ++] << 8;
-      pixel[col + 2]  = buffer[j ++] << 8;
-      pixel[col + 3]  = buffer[j ++] << 8;
-
-      /* Low-order packed bits from previous 4 pixels */
-      split           = buffer[j ++];
-      /* Unpack the bits, add to 16-bit values, left-justified */
-      pixel[col + 3] += (split & 0b11000000);
-      pixel[col + 2] += (split & 0b00110000) << 2;
-      pixel[col + 1] += (split & 0b00001100) << 4;
-      pixel[col + 0] += (split & 0b00000011) << 6;
-
-      /* Right adjust them */
-      pixel[col + 0] >>= (16 - RPI_RAW_BIT_DEPTH);
-      pixel[col + 1] >>= (16 - RPI_RAW_BIT_DEPTH);
-      pixel[col + 2] >>= (16 - RPI_RAW_BIT_DEPTH);
-      pixel[col + 3] >>= (16 - RPI_RAW_BIT_DEPTH);
-    }
-
-    if (TIFFWriteEncodedStrip(tif, row, pixel, fmt->width * 2) < 0) {
-      fprintf(stderr, "Error writing TIFF stripe at row %" PRIu64 ".\n", row);
-      goto fail;
+  for (; col + 2 < width; col ++) {
+    if (bpd_test(up, cur, down, col)) {
+      bpd_add(list, base + col, BPD_MAX_POINTS);
     }
   }
+}
 
-  TIFFWriteDirectory(tif);
+/*
+ * Index of a pixel read out with `flip' in unflipped sensor coordinates, or the
+ * other way round. The cache holds sensor coordinates, so that frames captured
+ * with and without -HF/-VF agree on where a bad pixel is.
+ */
+static uint32_t bpd_unflip(uint32_t index, const raw_fmt_t* fmt, int flip) {
+  uint32_t row = index / fmt->width;
+  uint32_t col = index % fmt->width;
 
-fail:
-  if (NULL != tif) {
-    TIFFClose(tif);
+  if (flip & RPI_RAW_CFA_FLIP_HORIZ) {
+    col = fmt->width - 1 - col;
   }
-
-  if (NULL != edata) {
-    exif_data_unref(edata);
+  if (flip & RPI_RAW_CFA_FLIP_VERT) {
+    row = fmt->height - 1 - row;
   }
 
-  if (NULL != ifp) {
-    fclose(ifp);
-  }
+  return row * fmt->width + col;
+}
+
+static int bpd_cmp(const void* a, const void* b) {
+  const uint32_t x = *(const uint32_t*) a;
+  const uint32_t y = *(const uint32_t*) b;
+
+  return (x < y) ? -1 : (x > y);
+}
+
+/* Move a list between readout and sensor coordinates, keeping it sorted */
+static void bpd_unflip_list(bpd_list_t* list, const raw_fmt_t* fmt, int flip) {
+  uint32_t i;
 
-  if (NULL != buffer) {
-    free(buffer);
+  if (0 == flip) {
+    return;
   }
 
-  if (NULL != pixel) {
-    free(pixel);
+  for (i = 0; i < list->count; i ++) {
+    list->index[i] = bpd_unflip(list->index[i], fmt, flip);
   }
+  qsort(list->index, list->count, sizeof(list->index[0]), bpd_cmp);
+}
 
-  if (NULL != dngFile) {
-    free(dngFile);
+/* Lens-capped or otherwise black, as far as the mean level tells */
+static bool is_dark(const raw_fmt_t* fmt, uint32_t mean) {
+  float black = 0;
+  int   i;
+
+  for (i = 0; i < 4; i ++) {
+    black = MAX(black, fmt->black_lvl[i]);
   }
 
-  return;
+  return mean <= black + BPM_DARK_MARGIN;
 }
 
-int main(int argc, char* argv[]) {
-  char* matrix  = NULL;
-  char* fout    = NULL;
-  char* fname   = NULL;
-  int   flip    = 0;
-  int   opt;
+static void bpm_key(char* key, size_t len, const char* model, const char* serial) {
+  char* p;
 
-  /* Scan options */
-  while ((opt = getopt(argc, argv, ":HVM:o:")) != -1) {
-    switch (opt) {
-    case 'H': {
-      flip |= RPI_RAW_CFA_FLIP_HORIZ;
-      break;
+  snprintf(key, len, "%s_%s", model, serial);
+  for (p = key; *p != '\0'; p ++) {
+    if (!(((*p >= '0') && (*p <= '9')) || ((*p >= 'a') && (*p <= 'z')) || ((*p >= 'A') && (*p <= 'Z')) || (*p == '_') || (*p == '-'))) {
+      *p = '_';
+    }
+  }
+}
+
+/* ID of the camera for the cache, `id' if given */
+static void get_serial(const exif_tags_t* tags, const char* id, char serial[BPM_MAX_SERIAL_LEN + 1]) {
+  const ExifEntry* eentry = NULL;
+
+  strcpy(serial, "0"); /* Raspberry Pi cameras do not report one */
+  if (NULL != id) {
+    snprintf(serial, BPM_MAX_SERIAL_LEN + 1, "%s", id);
+  } else if (NULL != (eentry = get_tag(tags, EXIF_IFD_EXIF, EXIF_TAG_BODY_SERIAL))) {
+    if ((eentry->size > 0) && ('\0' != eentry->data[0])) {
+      snprintf(serial, BPM_MAX_SERIAL_LEN + 1, "%.*s", (int) MIN(eentry->size, BPM_MAX_SERIAL_LEN), (const char*)eentry->data);
+    }
+  }
+}
+
+static bool bpm_read_u32(FILE* fp, uint32_t* v) {
+  if (1 != fread(v, sizeof(*v), 1, fp)) {
+    return false;
+  }
+  *v = le32toh(*v);
+  return true;
+}
+
+static bool bpm_write_u32(FILE* fp, uint32_t v) {
+  v = htole32(v);
+  return 1 == fwrite(&v, sizeof(v), 1, fp);
+}
+
+/*
+ * Merge hot/dead pixels found in this frame into the cache of this camera, and
+ * return the ones that are considered bad after the merge. Only dark frames are
+ * merged: in a scene, stars, glints and fine texture look just like hot pixels
+ * in every frame, while real hot pixels may drown.
+ *
+ * Cache file format (little-endian):
+ *   magic[8], width (u32), height (u32), frames (u32), count (u32),
+ *   count * {index (u32), hits (u32)} with ascending index, in unflipped sensor coordinates
+ */
+static int bpm_update(const char* dir, const char* key, const raw_fmt_t* fmt, const bpd_list_t* found, bool dark, bpd_list_t* bad) {
+  char      path[PATH_MAX];
+  char      magic[BPM_MAGIC_LEN];
+  uint32_t  width, height, frames = 0, count = 0;
+  uint32_t* old     = NULL; /* {index, hits} pairs */
+  uint32_t* merged  = NULL;
+  uint32_t  i, j, n, nfound;
+  int       fd      = -1;
+  int       ret     = EXIT_FAILURE;
+  FILE*     fp      = NULL;
+
+  snprintf(path, sizeof(path), "%s/%s.bpm", dir, key);
+  if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+    perror(path);
+    goto fail;
+  }
+  /* Other instances may be working on the same camera */
+  if (0 != flock(fd, LOCK_EX)) {
+    perror(path);
+    goto fail;
+  }
+  if (NULL == (fp = fdopen(fd, "r+b"))) {
+    perror(path);
+    goto fail;
+  }
+  fd = -1;
+
+  /* Load, a missing, broken or mismatching cache starts over */
+  if ((1 == fread(magic, BPM_MAGIC_LEN, 1, fp)) && (0 == memcmp(magic, BPM_MAGIC, BPM_MAGIC_LEN))
+   && bpm_read_u32(fp, &width) && bpm_read_u32(fp, &height) && bpm_read_u32(fp, &frames) && bpm_read_u32(fp, &count)
+   && (width == fmt->width) && (height == fmt->height) && (count <= (uint32_t)fmt->width * fmt->height)) {
+    if ((count > 0) && (NULL == (old = (uint32_t*) malloc(count * 2 * sizeof(old[0]))))) {
+      fprintf(stderr, "Cannot allocate memory for bad pixel cache!\n");
+      goto fail;
+    }
+    for (i = 0; i < count * 2; i ++) {
+      if (!bpm_read_u32(fp, &old[i])) {
+        fprintf(stderr, "Bad pixel cache `%s' is truncated, starting over.\n", path);
+        frames = 0;
+        count  = 0;
+        break;
+      }
+    }
+  } else {
+    frames = 0;
+    count  = 0;
+  }
+
+  if (!dark) {
+    fprintf(stderr, "Not a dark frame, not used for bad pixel detection.\n");
+  } else if (found->overflow) {
+    fprintf(stderr, "Too many outliers, frame not used for bad pixel detection.\n");
+  }
+  nfound = (!dark || found->overflow) ? 0 : found->count;
+
+  /* Merge (both lists are sorted) */
+  if (NULL == (merged = (uint32_t*) malloc((count + nfound + 1) * 2 * sizeof(merged[0])))) {
+    fprintf(stderr, "Cannot allocate memory for bad pixel cache!\n");
+    goto fail;
+  }
+  if (dark && !found->overflow) {
+    frames ++;
+  }
+  for (i = 0, j = 0, n = 0; (i < count) || (j < nfound); ) {
+    uint32_t index, hits;
+
+    if ((i < count) && ((j >= nfound) || (old[i * 2] < found->index[j]))) {
+      index = old[i * 2];
+      hits  = old[i * 2 + 1];
+      i ++;
+    } else if ((i < count) && (old[i * 2] == found->index[j])) {
+      index = old[i * 2];
+      hits  = old[i * 2 + 1] + 1;
+      i ++;
+      j ++;
+    } else {
+      index = found->index[j];
+      hits  = 1;
+      j ++;
+    }
+
+    /* Forget candidates seen in less than a quarter of all frames */
+    if ((frames >= BPM_PRUNE_FRAMES) && (hits * 4 < frames)) {
+      continue;
+    }
+
+    merged[n * 2]     = index;
+    merged[n * 2 + 1] = hits;
+    n ++;
+
+    if ((frames >= BPM_MIN_FRAMES) && (hits >= BPM_MIN_HITS) && (hits * 2 > frames)) {
+      bpd_add(bad, index, BPM_MAX_POINTS);
+    }
+  }
+
+  /* Save */
+  rewind(fp);
+  if ((1 != fwrite(BPM_MAGIC, BPM_MAGIC_LEN, 1, fp))
+   || !bpm_write_u32(fp, fmt->width) || !bpm_write_u32(fp, fmt->height) || !bpm_write_u32(fp, frames) || !bpm_write_u32(fp, n)) {
+    perror(path);
+    goto fail;
+  }
+  for (i = 0; i < n * 2; i ++) {
+    if (!bpm_write_u32(fp, merged[i])) {
+      perror(path);
+      goto fail;
+    }
+  }
+  if ((0 != fflush(fp)) || (0 != ftruncate(fileno(fp), ftell(fp)))) {
+    perror(path);
+    goto fail;
+  }
+
+  if (bad->overflow) {
+    fprintf(stderr, "Too many bad pixels, only the first %" PRIu32 " will be listed.\n", bad->count);
+  }
+  fprintf(stderr, "Bad pixels: %" PRIu32 " in this frame, %" PRIu32 " over %" PRIu32 " frame(s).\n", found->count, bad->count, frames);
+  ret = EXIT_SUCCESS;
+
+fail:
+  if (NULL != fp) {
+    fclose(fp); /* Also releases the lock */
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  if (NULL != old) {
+    free(old);
+  }
+
+  if (NULL != merged) {
+    free(merged);
+  }
+
+  return ret;
+}
+
+/* Emit OpcodeList1 with a single FixBadPixelsList opcode, see DNG specification 1.3 chapter 6. */
+static int write_bad_pixels(TIFF* tif, const bpd_list_t* bad, const raw_fmt_t* fmt, int flip, const char cfapatt[4]) {
+  uint32_t* list;
+  uint32_t  len, phase, index, i;
+
+  if (0 == bad->count) {
+    return EXIT_SUCCESS;
+  }
+
+  /* Opcode count, opcode header (ID, version, flags, parameter size), BayerPhase, point count, rect count, points */
+  len = 1 + 4 + 3 + bad->count * 2;
+  if (NULL == (list = (uint32_t*) malloc(len * sizeof(list[0])))) {
+    fprintf(stderr, "Cannot allocate memory for opcode list!\n");
+    return EXIT_FAILURE;
+  }
+
+  /* Color of the top-left pixel */
+  switch (cfapatt[0]) {
+    case TIFF_CFA_R: {
+      phase = 0;
+      break;
+    }
+    case TIFF_CFA_G: {
+      phase = (TIFF_CFA_R == cfapatt[1]) ? 1 : 2;
+      break;
+    }
+    default: {
+      phase = 3;
+      break;
+    }
+  }
+
+  /* Opcode lists are always big-endian */
+  list[0] = htobe32(1);
+  list[1] = htobe32(DNG_OPCODE_FIXBADPIXELSLIST);
+  list[2] = htobe32(DNG_OPCODE_VER);
+  list[3] = htobe32(DNG_OPCODE_FLAG_OPTIONAL);
+  list[4] = htobe32((3 + bad->count * 2) * sizeof(list[0]));
+  list[5] = htobe32(phase);
+  list[6] = htobe32(bad->count);
+  list[7] = htobe32(0);
+  for (i = 0; i < bad->count; i ++) {
+    index               = bpd_unflip(bad->index[i], fmt, flip); /* Back to this readout */
+    list[8 + i * 2]     = htobe32(index / fmt->width); /* Row */
+    list[8 + i * 2 + 1] = htobe32(index % fmt->width); /* Column */
+  }
+
+  TIFFSetField(tif, TIFFTAG_DNGVERSION, DNG_VER_OPCODES);
+  TIFFSetField(tif, TIFFTAG_OPCODELIST1, len * (uint32_t)sizeof(list[0]), list);
+  free(list);
+
+  return EXIT_SUCCESS;
+}
+
+/* Rows just outside the band are unpacked into `halo' (2 above, then 2 below) for bad pixel detection */
+static uint16_t* band_row(const unpack_ctx_t* ctx, uint16_t* halo, uint32_t first, uint32_t last, uint32_t row) {
+  if (row < first) {
+    return halo + (first - row - 1) * ctx->fmt->width;
+  }
+  if (row >= last) {
+    return halo + (2 + row - last) * ctx->fmt->width;
+  }
+  return ctx->pixel + row * ctx->fmt->width;
+}
+
+static uint32_t row_sum(const uint16_t* line, uint16_t width) {
+  uint32_t  sum = 0; /* 10-bit samples, cannot overflow */
+  unsigned  col;
+
+  for (col = 0; col < width; col ++) {
+    sum += line[col];
+  }
+
+  return sum;
+}
+
+/* Take bands of the frame until there are none left */
+static void unpack_bands(unpack_ctx_t* ctx, unsigned char* buffer, uint16_t* halo) {
+  const raw_fmt_t*  fmt     = ctx->fmt;
+  uint32_t          band, first, last, from, to, row;
+  size_t            len;
+  uint8_t           state;
+  bool              stop;
+
+  for (;;) {
+    pthread_mutex_lock(&ctx->lock);
+    band = ctx->next ++;
+    stop = ctx->abort || (band >= ctx->bands);
+    pthread_mutex_unlock(&ctx->lock);
+    if (stop) {
+      break;
+    }
+
+    state = BAND_DONE;
+    first = band * ctx->band_rows;
+    last  = MIN(first + ctx->band_rows, fmt->height);
+    from  = (ctx->detect && (first >= 2)) ? (first - 2) : first;
+    to    = ctx->detect ? MIN(last + 2, fmt->height) : last;
+    len   = (size_t)(to - from) * fmt->row_len;
+
+    if ((ssize_t)len != pread(ctx->fd, buffer, len, ctx->offset + (uint64_t)from * fmt->row_len)) {
+      fprintf(stderr, "Cannot read RAW data for rows %" PRIu32 "-%" PRIu32 ".\n", from, to - 1);
+      state = BAND_FAILED;
+    } else {
+      for (row = from; row < to; row ++) {
+        rpiraw_unpack_row(buffer + (size_t)(row - from) * fmt->row_len, band_row(ctx, halo, first, last, row), fmt->width);
+      }
+
+      if (ctx->detect) {
+        for (row = MAX(first, 2); (row < last) && (row + 2 < fmt->height); row ++) {
+          bpd_scan_row(band_row(ctx, halo, first, last, row - 2), band_row(ctx, halo, first, last, row),
+                       band_row(ctx, halo, first, last, row + 2), fmt->width, row * fmt->width, &ctx->found[band]);
+        }
+        for (row = first; row < last; row ++) {
+          ctx->sum[band] += row_sum(ctx->pixel + row * fmt->width, fmt->width);
+        }
+      }
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->state[band] = state;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+  }
+}
+
+static void* band_worker(void* arg) {
+  conv_buf_t*   buf   = ((unpack_arg_t*) arg)->buf;
+  int           id    = ((unpack_arg_t*) arg)->id;
+  uint32_t      frame = 0;
+  unpack_ctx_t* ctx;
+
+  pthread_mutex_lock(&buf->lock);
+  for (;;) {
+    while (!buf->quit && ((frame == buf->frame) || (id >= buf->active))) {
+      pthread_cond_wait(&buf->wake, &buf->lock);
+    }
+    if (buf->quit) {
+      break;
+    }
+    frame = buf->frame;
+    ctx   = buf->ctx;
+    pthread_mutex_unlock(&buf->lock);
+
+    unpack_bands(ctx, buf->band[id], buf->halo[id]);
+
+    pthread_mutex_lock(&buf->lock);
+    if (0 == -- buf->busy) {
+      pthread_cond_signal(&buf->idle);
+    }
+  }
+  pthread_mutex_unlock(&buf->lock);
+
+  return NULL;
+}
+
+/* Make sure `*p' holds at least `want' bytes, contents are not preserved */
+static bool reserve(void** p, size_t* len, size_t want) {
+  if (*len >= want) {
+    return true;
+  }
+
+  free(*p);
+  if (NULL == (*p = malloc(want))) {
+    *len = 0;
+    return false;
+  }
+
+  *len = want;
+  return true;
+}
+
+static void buf_init(conv_buf_t* buf) {
+  memset(buf, 0, sizeof(*buf));
+  pthread_mutex_init(&buf->lock, NULL);
+  pthread_cond_init(&buf->wake, NULL);
+  pthread_cond_init(&buf->idle, NULL);
+}
+
+static void buf_free(conv_buf_t* buf) {
+  int i;
+
+  pthread_mutex_lock(&buf->lock);
+  buf->quit = true;
+  pthread_cond_broadcast(&buf->wake);
+  pthread_mutex_unlock(&buf->lock);
+  while (buf->started > 0) {
+    pthread_join(buf->tid[-- buf->started], NULL);
+  }
+
+  free(buf->pixel);
+  for (i = 0; i < RPI_MAX_THREADS; i ++) {
+    free(buf->band[i]);
+    free(buf->halo[i]);
+  }
+  for (i = 0; i < MAX_BANDS; i ++) {
+    bpd_free(&buf->found[i]);
+  }
+
+  pthread_cond_destroy(&buf->idle);
+  pthread_cond_destroy(&buf->wake);
+  pthread_mutex_destroy(&buf->lock);
+}
+
+/*
+ * Unpack the frame in bands of rows on `threads' workers, while writing the
+ * strips in order as the bands complete. Workers are started on first use and
+ * then kept in `buf' for the following frames.
+ */
+static int unpack_and_write(TIFF* tif, FILE* ifp, uint64_t offset, const raw_fmt_t* fmt, conv_buf_t* buf, int threads, bool detect, bpd_list_t* found, uint32_t* mean) {
+  unpack_ctx_t  ctx;
+  uint16_t*     pixel   = buf->pixel;
+  int           active;
+  int           ret     = EXIT_FAILURE;
+  uint32_t      band, row, i;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.fmt       = fmt;
+  ctx.fd        = fileno(ifp);
+  ctx.offset    = offset;
+  ctx.pixel     = pixel;
+  ctx.detect    = detect;
+  ctx.band_rows = (fmt->height + threads * BANDS_PER_THREAD - 1) / (threads * BANDS_PER_THREAD);
+  ctx.bands     = (fmt->height + ctx.band_rows - 1) / ctx.band_rows; /* No more than MAX_BANDS */
+  ctx.state     = buf->state;
+  ctx.found     = buf->found;
+  ctx.sum       = buf->sum;
+  pthread_mutex_init(&ctx.lock, NULL);
+  pthread_cond_init(&ctx.cond, NULL);
+
+  for (band = 0; band < ctx.bands; band ++) {
+    ctx.state[band]           = BAND_PENDING;
+    ctx.found[band].count     = 0;
+    ctx.found[band].overflow  = false;
+    ctx.sum[band]             = 0;
+  }
+
+  /* Workers are idle between frames, so their buffers can be replaced here */
+  for (active = 0; active < threads; active ++) {
+    if (!reserve((void**)&buf->band[active], &buf->band_len[active], (ctx.band_rows + 4) * fmt->row_len)
+     || !reserve((void**)&buf->halo[active], &buf->halo_len[active], 4 * fmt->width * sizeof(buf->halo[0][0]))) {
+      fprintf(stderr, "Cannot allocate memory for image data!\n");
+      break;
+    }
+    if (active == buf->started) {
+      buf->arg[active].buf  = buf;
+      buf->arg[active].id   = active;
+      if (0 != pthread_create(&buf->tid[active], NULL, band_worker, &buf->arg[active])) {
+        break;
+      }
+      buf->started ++;
+    }
+  }
+  if (0 == active) {
+    fprintf(stderr, "Cannot start worker threads!\n");
+    goto fail;
+  }
+
+  pthread_mutex_lock(&buf->lock);
+  buf->ctx    = &ctx;
+  buf->active = active;
+  buf->busy   = active;
+  buf->frame ++;
+  pthread_cond_broadcast(&buf->wake);
+  pthread_mutex_unlock(&buf->lock);
+
+  ret = EXIT_SUCCESS;
+  for (band = 0; band < ctx.bands; band ++) {
+    pthread_mutex_lock(&ctx.lock);
+    while (BAND_PENDING == ctx.state[band]) {
+      pthread_cond_wait(&ctx.cond, &ctx.lock);
+    }
+    pthread_mutex_unlock(&ctx.lock);
+
+    if (BAND_FAILED == ctx.state[band]) {
+      ret = EXIT_FAILURE;
+      break;
+    }
+
+    for (row = band * ctx.band_rows; row < MIN((band + 1) * ctx.band_rows, fmt->height); row ++) {
+      if (TIFFWriteEncodedStrip(tif, row, pixel + row * fmt->width, fmt->width * 2) < 0) {
+        fprintf(stderr, "Error writing TIFF stripe at row %" PRIu32 ".\n", row);
+        ret = EXIT_FAILURE;
+        break;
+      }
+    }
+    if (EXIT_SUCCESS != ret) {
+      break;
+    }
+  }
+
+  /* Workers are done with the frame by now unless something failed */
+  pthread_mutex_lock(&ctx.lock);
+  ctx.abort = true;
+  pthread_mutex_unlock(&ctx.lock);
+  pthread_mutex_lock(&buf->lock);
+  while (buf->busy > 0) {
+    pthread_cond_wait(&buf->idle, &buf->lock);
+  }
+  buf->ctx = NULL;
+  pthread_mutex_unlock(&buf->lock);
+
+  /* Bands are in order, so are the outliers */
+  if ((EXIT_SUCCESS == ret) && detect) {
+    uint64_t sum = 0;
+
+    for (band = 0; band < ctx.bands; band ++) {
+      sum += ctx.sum[band];
+      found->overflow |= ctx.found[band].overflow;
+      for (i = 0; i < ctx.found[band].count; i ++) {
+        bpd_add(found, ctx.found[band].index[i], BPD_MAX_POINTS);
+      }
+    }
+    *mean = sum / ((uint64_t)fmt->width * fmt->height);
+  }
+
+fail:
+  pthread_cond_destroy(&ctx.cond);
+  pthread_mutex_destroy(&ctx.lock);
+
+  return ret;
+}
+
+static uint64_t now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Same as exif_data_new_from_file(), but works on whatever `ifp' is opened from */
+static ExifData* load_exif(FILE* ifp) {
+  ExifLoader*   loader;
+  ExifData*     edata;
+  unsigned char buffer[1024];
+  size_t        len;
+
+  if (NULL == (loader = exif_loader_new())) {
+    return NULL;
+  }
+
+  rewind(ifp);
+  while (0 != (len = fread(buffer, 1, sizeof(buffer), ifp))) {
+    if (!exif_loader_write(loader, buffer, len)) {
+      break;
+    }
+  }
+
+  edata = exif_loader_get_data(loader);
+  exif_loader_unref(loader);
+
+  return edata;
+}
+
+/* Input is opened from `inFd' if it is not negative, `inFile' is then only used for naming. */
+static int process_file(conv_buf_t* buf, const char* inFile, int inFd, const conv_opts_t* opts, conv_stats_t* stats) {
+  uint64_t          offset;
+  uint64_t          start   = now_usec();
+  char              cfapatt[4];
+  char              serial[BPM_MAX_SERIAL_LEN + 1];
+  char              bpmKey[RPI_RAW_MAX_MODEL_LEN + BPM_MAX_SERIAL_LEN + 2];
+  bpd_list_t        found   = {0};  /* Outliers in this frame */
+  bpd_list_t        bad     = {0};  /* Bad pixels according to cache */
+  uint32_t          mean    = 0;    /* Frame level */
+  int               ret     = EXIT_FAILURE;
+
+  char*             dngFile = NULL;
+  FILE*             ifp     = NULL;
+  TIFF*             tif     = NULL;
+  ExifData*         edata   = NULL;
+  exif_tags_t       tags;
+  const raw_fmt_t*  fmt     = NULL;
+
+  memset(stats, 0, sizeof(*stats));
+
+  if ((NULL == inFile) && (NULL == opts->out)) {
+    fprintf(stderr, "Neither input nor output file name given.\n");
+    goto fail;
+  }
+
+  /* Check file existence */
+  if (inFd >= 0) {
+    int fd = dup(inFd);
+    if ((fd < 0) || (NULL == (ifp = fdopen(fd, "rb")))) {
+      perror("Passed file");
+      if (fd >= 0) {
+        close(fd);
+      }
+      goto fail;
+    }
+  } else if (NULL == (ifp = fopen(inFile, "rb"))) {
+    perror(inFile);
+    goto fail;
+  }
+
+  /* Load and check EXIF-data */
+  if (NULL == (edata = load_exif(ifp))) {
+    fprintf(stderr, "No EXIF data found, hence no RAW data.\n");
+    goto fail;
+  }
+
+  collect_tags(edata, &tags);
+
+  /* Determine format */
+  if (NULL == (fmt = get_format(&tags))) {
+    fprintf(stderr, "File format unsupported.\n");
+    goto fail;
+  }
+
+  /* Location in file the raw pixel data starts */
+  offset = get_data_offset(ifp, fmt);
+  if (0 == offset) {
+    fprintf(stderr, "Cannot determine RAW data offset.\n");
+    goto fail;
+  }
+  fprintf(stderr, "Found RAW data @ offset %" PRIu64 ".\n", offset);
+
+  /* Allocate memory for pixel data */
+  if (!reserve((void**)&buf->pixel, &buf->pixel_len, fmt->width * fmt->height * sizeof(buf->pixel[0]))) {
+    fprintf(stderr, "Cannot allocate memory for image data!\n");
+    goto fail;
+  }
+
+  /* Generate DNG file name */
+  if (NULL == opts->out) {
+    if (NULL == (dngFile = rpiraw_sibling(inFile, "dng"))) {
+      fprintf(stderr, "Cannot name output after `%s', use -o.\n", inFile);
+      goto fail;
+    }
+  } else if (NULL == (dngFile = strdup(opts->out))) {
+    fprintf(stderr, "Cannot allocate memory!\n");
+    goto fail;
+  }
+
+  /* Create output TIFF file */
+  if (NULL == (tif = TIFFOpen(dngFile, "w"))) {
+    fprintf(stderr, "Cannot create/open output file `%s'.\n", dngFile);
+    goto fail;
+  }
+  fprintf(stderr, "Creating %s...\n", dngFile);
+
+  /* Copy metadata */
+  if (EXIT_SUCCESS != copy_tags(&tags, tif, opts->has_matrix ? opts->matrix : NULL, inFile, fmt, opts->flip)) {
+    goto fail;
+  }
+
+  /* Unpack and copy RAW data */
+  fprintf(stderr, "Extracting RAW data...\n");
+  if (EXIT_SUCCESS != unpack_and_write(tif, ifp, offset, fmt, buf, opts->threads, NULL != opts->bpm_dir, &found, &mean)) {
+    goto fail;
+  }
+
+  /* Bad pixel map */
+  if (NULL != opts->bpm_dir) {
+    get_serial(&tags, opts->camera_id, serial);
+    bpm_key(bpmKey, sizeof(bpmKey), fmt->model, serial);
+    get_cfa_pattern(fmt, opts->flip, cfapatt);
+    bpd_unflip_list(&found, fmt, opts->flip);
+    if ((EXIT_SUCCESS != bpm_update(opts->bpm_dir, bpmKey, fmt, &found, is_dark(fmt, mean), &bad))
+     || (EXIT_SUCCESS != write_bad_pixels(tif, &bad, fmt, opts->flip, cfapatt))) {
+      fprintf(stderr, "Bad pixels will not be listed.\n");
+    } else {
+      stats->bad_pixels = bad.count;
+    }
+  }
+
+  if (TIFFWriteDirectory(tif)) {
+    ret = EXIT_SUCCESS;
+  }
+
+fail:
+  if (NULL != tif) {
+    TIFFClose(tif);
+  }
+
+  if (NULL != edata) {
+    exif_data_unref(edata);
+  }
+
+  if (NULL != ifp) {
+    fclose(ifp);
+  }
+
+  if (NULL != dngFile) {
+    free(dngFile);
+  }
+
+  bpd_free(&found);
+  bpd_free(&bad);
+
+  stats->usec = now_usec() - start;
+
+  return ret;
+}
+
+static void init_opts(conv_opts_t* opts) {
+  memset(opts, 0, sizeof(*opts));
+  opts->threads = MAX(1, MIN(sysconf(_SC_NPROCESSORS_ONLN), RPI_MAX_THREADS));
+}
+
+/* Apply one of RPI2DNG_CONV_OPTS, for both the command line and server requests */
+static bool set_option(conv_opts_t* opts, int opt, char* arg) {
+  switch (opt) {
+    case 'H': {
+      opts->flip |= RPI_RAW_CFA_FLIP_HORIZ;
+      break;
     }
     case 'V': {
-      flip |= RPI_RAW_CFA_FLIP_VERT;
+      opts->flip |= RPI_RAW_CFA_FLIP_VERT;
       break;
     }
     case 'M': {
-      matrix   = strdup(optarg);
+      if (9 != read_matrix(opts->matrix, arg)) {
+        fprintf(stderr, "Color matrix needs 9 comma-separated numbers.\n");
+        return false;
+      }
+      opts->has_matrix = true;
       break;
     }
     case 'o': {
-      fout     = strdup(optarg);
+      opts->out     = arg;
       break;
     }
-    default: /* '?' */
-      usage(argv[0]);
+    case 'B': {
+      opts->bpm_dir = arg;
+      break;
+    }
+    case 'C': {
+      opts->camera_id = arg;
+      break;
+    }
+    case 'j': {
+      opts->threads = atoi(arg);
+      if (opts->threads < 1) {
+        return false;
+      }
+      break;
+    }
+    default: {
+      return false;
+    }
+  }
+
+  opts->threads = MIN(opts->threads, RPI_MAX_THREADS);
+  return true;
+}
+
+static void* server_worker(void* arg) {
+  server_t*   srv = (server_t*) arg;
+  conv_buf_t  buf;
+  job_t*      job;
+
+  buf_init(&buf);
+
+  for (;;) {
+    pthread_mutex_lock(&srv->lock);
+    while (NULL == srv->head) {
+      pthread_cond_wait(&srv->ready, &srv->lock);
+    }
+    job = srv->head;
+    srv->head = job->next;
+    if (NULL == srv->head) {
+      srv->tail = NULL;
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    job->wait_usec  = now_usec() - job->queued;
+    job->status     = process_file(&buf, job->in, job->fd, &job->opts, &job->stats);
+
+    pthread_mutex_lock(&srv->lock);
+    job->done = true;
+    pthread_cond_broadcast(&srv->done);
+    pthread_mutex_unlock(&srv->lock);
+  }
+
+  return NULL;
+}
+
+/* Parse a request (NUL-terminated tokens) into `job', tokens stay in `msg' */
+static bool parse_request(const server_t* srv, char* msg, size_t len, job_t* job) {
+  char*   token[SERVER_MAX_TOKENS];
+  size_t  count = 0, i;
+  char*   p;
+
+  if ((0 == len) || ('\0' != msg[len - 1])) {
+    return false;
+  }
+  for (p = msg; p < msg + len; p += strlen(p) + 1) {
+    if (count == SERVER_MAX_TOKENS) {
+      return false;
+    }
+    token[count ++] = p;
+  }
+
+  job->opts = srv->defaults;
+  job->opts.out = NULL; /* Never shared between files */
+  job->in = NULL;
+  for (i = 0; i < count; i ++) {
+    const char* spec;
+
+    if (('-' == token[i][0]) && ('\0' != token[i][1]) && ('\0' == token[i][2])
+     && (':' != token[i][1]) && (NULL != (spec = strchr(RPI2DNG_CONV_OPTS, token[i][1])))) {
+      char* arg = NULL;
+      if (':' == spec[1]) {
+        if (i + 1 == count) {
+          return false;
+        }
+        arg = token[i + 1];
+      }
+      if (!set_option(&job->opts, spec[0], arg)) {
+        return false;
+      }
+      i += (NULL != arg);
+    } else if (NULL == job->in) {
+      job->in = token[i];
+    } else {
+      return false; /* One file per request */
+    }
+  }
+
+  if (NULL == job->opts.out) {
+    char* dng;
+
+    /* The output is named after the input, which must have an extension to replace */
+    if ((NULL == job->in) || (NULL == (dng = rpiraw_sibling(job->in, "dng")))) {
+      return false;
+    }
+    free(dng);
+    return true;
+  }
+
+  return (NULL != job->in) || (job->fd >= 0);
+}
+
+/* Serve requests from one client, one at a time */
+static void* server_conn(void* arg) {
+  server_t*       srv   = ((void**) arg)[0];
+  int             conn  = (int)(intptr_t)((void**) arg)[1];
+  char            msg[RPI2DNG_MAX_MSG];
+  char            reply[RPI2DNG_MAX_REPLY];
+  char            cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec    iov;
+  struct msghdr   mh;
+  struct cmsghdr* cm;
+  job_t           job;
+  ssize_t         len;
+
+  free(arg);
+
+  for (;;) {
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base        = msg;
+    iov.iov_len         = sizeof(msg);
+    mh.msg_iov          = &iov;
+    mh.msg_iovlen       = 1;
+    mh.msg_control      = cbuf;
+    mh.msg_controllen   = sizeof(cbuf);
+    if ((len = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC)) <= 0) {
+      break;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.fd = -1;
+    for (cm = CMSG_FIRSTHDR(&mh); NULL != cm; cm = CMSG_NXTHDR(&mh, cm)) {
+      if ((SOL_SOCKET == cm->cmsg_level) && (SCM_RIGHTS == cm->cmsg_type)) {
+        memcpy(&job.fd, CMSG_DATA(cm), sizeof(int));
+      }
+    }
+
+    if ((mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || !parse_request(srv, msg, len, &job)) {
+      snprintf(reply, sizeof(reply), "status=%d error=bad_request", EXIT_FAILURE);
+    } else {
+      job.queued = now_usec();
+      pthread_mutex_lock(&srv->lock);
+      if (NULL == srv->tail) {
+        srv->head = &job;
+      } else {
+        srv->tail->next = &job;
+      }
+      srv->tail = &job;
+      pthread_cond_signal(&srv->ready);
+      while (!job.done) {
+        pthread_cond_wait(&srv->done, &srv->lock);
+      }
+      pthread_mutex_unlock(&srv->lock);
+
+      snprintf(reply, sizeof(reply), "status=%d time_us=%" PRIu64 " wait_us=%" PRIu64 " bad_pixels=%" PRIu32,
+               job.status, job.stats.usec, job.wait_usec, job.stats.bad_pixels);
+    }
+
+    if (job.fd >= 0) {
+      close(job.fd);
+    }
+    if (send(conn, reply, strlen(reply) + 1, 0) < 0) {
+      break;
+    }
+  }
+
+  close(conn);
+  return NULL;
+}
+
+static int serve(const char* path, const conv_opts_t* defaults, int workers) {
+  server_t            srv;
+  struct sockaddr_un  addr;
+  struct stat         st;
+  pthread_t           tid;
+  int                 sock, conn, i;
+
+  memset(&srv, 0, sizeof(srv));
+  srv.defaults = *defaults;
+  pthread_mutex_init(&srv.lock, NULL);
+  pthread_cond_init(&srv.ready, NULL);
+  pthread_cond_init(&srv.done, NULL);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long.\n");
+    return EXIT_FAILURE;
+  }
+  strcpy(addr.sun_path, path);
+
+  if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+    perror("socket");
+    return EXIT_FAILURE;
+  }
+  /* Stale socket from a previous run, but never anything else (e.g. a mistyped -S img.jpg) */
+  if (0 == lstat(path, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "`%s' exists and is not a socket.\n", path);
+      close(sock);
+      return EXIT_FAILURE;
+    }
+    unlink(path);
+  }
+  if ((0 != bind(sock, (struct sockaddr*)&addr, sizeof(addr))) || (0 != listen(sock, SERVER_BACKLOG))) {
+    perror(path);
+    close(sock);
+    return EXIT_FAILURE;
+  }
+
+  /* Clients going away must not kill the server */
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < workers; i ++) {
+    if (0 != pthread_create(&tid, NULL, server_worker, &srv)) {
+      perror("pthread_create");
+      close(sock);
+      return EXIT_FAILURE;
     }
+    pthread_detach(tid);
   }
+  fprintf(stderr, "Serving on %s with %d worker(s).\n", path, workers);
+
+  for (;;) {
+    void** arg;
+
+    if ((conn = accept(sock, NULL, NULL)) < 0) {
+      if (EINTR != errno) {
+        perror("accept");
+      }
+      continue;
+    }
+
+    if (NULL == (arg = (void**) malloc(2 * sizeof(void*)))) {
+      close(conn);
+      continue;
+    }
+    arg[0] = &srv;
+    arg[1] = (void*)(intptr_t)conn;
+    if (0 != pthread_create(&tid, NULL, server_conn, arg)) {
+      perror("pthread_create");
+      free(arg);
+      close(conn);
+      continue;
+    }
+    pthread_detach(tid);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+  conv_opts_t   opts;
+  conv_buf_t    buf;
+  conv_stats_t  stats;
+  char*         fname   = NULL;
+  char*         sock    = NULL;
+  int           workers = 1;
+  int           opt;
 
-  /* Expect at least one input-filename */
-  if (optind >= argc) {
-    usage(argv[0]);
+  init_opts(&opts);
+  buf_init(&buf);
+
+  /* Scan options */
+  while ((opt = getopt(argc, argv, ":" RPI2DNG_CONV_OPTS "S:W:")) != -1) {
+    switch (opt) {
+    case 'S': {
+      sock     = optarg;
+      break;
+    }
+    case 'W': {
+      workers  = atoi(optarg);
+      if (workers < 1) {
+        usage(argv[0]);
+      }
+      break;
+    }
+    default: /* '?' */
+      if (!set_option(&opts, opt, optarg)) {
+        usage(argv[0]);
+      }
+    }
   }
 
-  /* Prevent user from setting output file name when multiple files are supplied */
-  if ((optind < argc - 1) && (fout != NULL)) {
-    usage(argv[0]);
+  if (NULL != sock) {
+    /* Files come from requests, and each has its own output */
+    if ((optind < argc) || (NULL != opts.out)) {
+      usage(argv[0]);
+    }
+  } else {
+    /* Expect at least one input-filename */
+    if (optind >= argc) {
+      usage(argv[0]);
+    }
+
+    /* Prevent user from setting output file name when multiple files are supplied */
+    if ((optind < argc - 1) && (opts.out != NULL)) {
+      usage(argv[0]);
+    }
   }
 
-  if (flip != 0) {
+  if (opts.flip != 0) {
     fprintf(stderr, "NOTE: you have enabled flipping. A better way is to record as is, and then flip in the photo processing software, e.g. darktable.");
   }
 
+  /* Register DNG tags unknown to libTIFF */
+  rpiraw_register_tags();
+
+  if (NULL != sock) {
+    return serve(sock, &opts, workers);
+  }
+
   /* Scan file names */
   while (optind < argc) {
     fname = argv[optind ++];
     fprintf(stderr, "\n%s:\n", fname);
-    process_file(fname, fout, matrix, flip);
+    process_file(&buf, fname, -1, &opts, &stats);
   }
 
   /* Clean up */
-  if (NULL != matrix) {
-    free(matrix);
-  }
-  if (NULL != fout) {
-    free(fout);
-  }
+  buf_free(&buf);
 
   return EXIT_SUCCESS;
 }
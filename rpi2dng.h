@@ -0,0 +1,22 @@
+/*
+ * Conversion server protocol, shared by `rpi2dng -S' and `rpi2dngc'.
+ *
+ * The server listens on a SOCK_SEQPACKET Unix domain socket. Each request is
+ * one message of NUL-terminated tokens, like argv: conversion options followed
+ * by exactly one input file name. Instead of being opened by name, the input
+ * can be passed as an open file descriptor (SCM_RIGHTS), in which case the name
+ * is only used to name the output (and may be omitted when `-o' is given).
+ * Paths are resolved by the server, so they should be absolute.
+ *
+ * Each request gets one reply: a NUL-terminated line of `key=value' pairs,
+ * starting with `status=' (0 on success).
+ */
+
+#ifndef __RPI2DNG_H__
+#define __RPI2DNG_H__
+
+#define RPI2DNG_CONV_OPTS       "HVM:o:B:C:j:"  /* Options that apply to each file, also accepted in requests */
+#define RPI2DNG_MAX_MSG         4096
+#define RPI2DNG_MAX_REPLY       256
+
+#endif /* __RPI2DNG_H__ */
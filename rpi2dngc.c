@@ -0,0 +1,208 @@
+/*
+ * Client for `rpi2dng -S socket', mainly for testing the server locally.
+ *
+ * Sends one conversion request per input file and prints the reply. Paths are
+ * made absolute, as the server resolves them on its own. With -F, the input is
+ * opened here and passed to the server as file descriptor.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "rpi2dng.h"
+
+
+static void usage(const char* self) {
+  fprintf(stderr, "Usage: %s [-F] socket [options] infile1.jpg [infile2.jpg ...]\n\n"
+    "Options:\n"
+      "\t-F          Pass opened input files instead of their names\n"
+      "\tOther options are sent along, see rpi2dng\n",
+    self);
+  exit(EXIT_FAILURE);
+}
+
+/* Append a NUL-terminated token to the request */
+static bool add_token(char* msg, size_t* len, const char* token) {
+  size_t n = strlen(token) + 1;
+
+  if (*len + n > RPI2DNG_MAX_MSG) {
+    fprintf(stderr, "Request too long.\n");
+    return false;
+  }
+
+  memcpy(msg + *len, token, n);
+  *len += n;
+  return true;
+}
+
+static bool add_path(char* msg, size_t* len, const char* path) {
+  char cwd[PATH_MAX];
+  char abs[PATH_MAX * 2];
+
+  if ('/' == path[0]) {
+    return add_token(msg, len, path);
+  }
+
+  if (NULL == getcwd(cwd, sizeof(cwd))) {
+    perror("getcwd");
+    return false;
+  }
+  snprintf(abs, sizeof(abs), "%s/%s", cwd, path);
+  return add_token(msg, len, abs);
+}
+
+static int request(int sock, const char* msg, size_t len, int fd) {
+  char            reply[RPI2DNG_MAX_REPLY];
+  char            cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec    iov;
+  struct msghdr   mh;
+  struct cmsghdr* cm;
+  ssize_t         n;
+  int             status;
+
+  memset(&mh, 0, sizeof(mh));
+  iov.iov_base  = (void*) msg;
+  iov.iov_len   = len;
+  mh.msg_iov    = &iov;
+  mh.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(cbuf, 0, sizeof(cbuf));
+    mh.msg_control    = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    cm                = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level    = SOL_SOCKET;
+    cm->cmsg_type     = SCM_RIGHTS;
+    cm->cmsg_len      = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+  }
+
+  if (sendmsg(sock, &mh, 0) < 0) {
+    perror("sendmsg");
+    return EXIT_FAILURE;
+  }
+
+  if ((n = recv(sock, reply, sizeof(reply) - 1, 0)) <= 0) {
+    fprintf(stderr, "No reply from server.\n");
+    return EXIT_FAILURE;
+  }
+  reply[n] = '\0';
+  printf("%s\n", reply);
+
+  if (1 != sscanf(reply, "status=%d", &status)) {
+    return EXIT_FAILURE;
+  }
+  return status;
+}
+
+int main(int argc, char* argv[]) {
+  struct sockaddr_un  addr;
+  char                opts[RPI2DNG_MAX_MSG];
+  char                msg[RPI2DNG_MAX_MSG];
+  size_t              opts_len  = 0;
+  size_t              len;
+  bool                pass_fd   = false;
+  bool                has_out   = false;
+  int                 ret       = EXIT_SUCCESS;
+  int                 sock, fd, opt;
+  const char*         path;
+
+  /* Own options first, stopping at the socket */
+  while ((opt = getopt(argc, argv, "+F")) != -1) {
+    switch (opt) {
+    case 'F': {
+      pass_fd = true;
+      break;
+    }
+    default: /* '?' */
+      usage(argv[0]);
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+  }
+  path = argv[optind ++];
+
+  /* Conversion options, sent with each file */
+  argv[optind - 1] = argv[0]; /* So that getopt() carries on after the socket */
+  argv    += optind - 1;
+  argc    -= optind - 1;
+  optind  = 1;
+  while ((opt = getopt(argc, argv, ":" RPI2DNG_CONV_OPTS)) != -1) {
+    char token[3] = {'-', (char) opt, '\0'};
+
+    if (('?' == opt) || (':' == opt)) {
+      usage(argv[0]);
+    }
+    if (!add_token(opts, &opts_len, token)) {
+      return EXIT_FAILURE;
+    }
+    if (('o' == opt) || ('B' == opt)) {
+      has_out |= ('o' == opt);
+      if (!add_path(opts, &opts_len, optarg)) {
+        return EXIT_FAILURE;
+      }
+    } else if ((NULL != optarg) && !add_token(opts, &opts_len, optarg)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* Expect at least one input-filename, and only one if the output is named */
+  if ((optind >= argc) || (has_out && (optind < argc - 1))) {
+    usage(argv[0]);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long.\n");
+    return EXIT_FAILURE;
+  }
+  strcpy(addr.sun_path, path);
+  if ((sock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) {
+    perror("socket");
+    return EXIT_FAILURE;
+  }
+  if (0 != connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    perror(path);
+    close(sock);
+    return EXIT_FAILURE;
+  }
+
+  for (; optind < argc; optind ++) {
+    printf("%s: ", argv[optind]);
+    fflush(stdout);
+
+    memcpy(msg, opts, opts_len);
+    len = opts_len;
+    if (!add_path(msg, &len, argv[optind])) {
+      ret = EXIT_FAILURE;
+      continue;
+    }
+
+    fd = -1;
+    if (pass_fd && ((fd = open(argv[optind], O_RDONLY)) < 0)) {
+      perror(argv[optind]);
+      ret = EXIT_FAILURE;
+      continue;
+    }
+
+    if (EXIT_SUCCESS != request(sock, msg, len, fd)) {
+      ret = EXIT_FAILURE;
+    }
+
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  close(sock);
+  return ret;
+}
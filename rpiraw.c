@@ -0,0 +1,185 @@
+/* Raspberry Pi "RAW" JPEG formats and helpers shared by rpi2dng and rpitrunc. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tiffio.h>
+
+#include "rpiraw.h"
+
+
+const raw_fmt_t fmt_ov5647_old = {
+  .width        = 2592,
+  .height       = 1944,
+  .row_len      = 3264,     /* 8-pixel padding + other stuff, 24 bytes total */
+  .raw_len      = 6404096,
+
+  .cfa_pattern  = RPI_RAW_CFA_PATT_OLD,
+  .black_lvl    = BLC_OV5647,
+  .model        = "ov5647",
+};
+
+const raw_fmt_t fmt_ov5647_new = {
+  .width        = 2592,
+  .height       = 1944,
+  .row_len      = 3264,     /* 8-pixel padding + other stuff, 24 bytes total */
+  .raw_len      = 6404096,
+
+  .cfa_pattern  = RPI_RAW_CFA_PATT_NEW,
+  .black_lvl    = BLC_OV5647,
+  .model        = "RP_ov5647",
+};
+
+const raw_fmt_t fmt_ov5647_new2 = {
+  .width        = 2592,
+  .height       = 1944,
+  .row_len      = 3264,     /* 8-pixel padding + other stuff, 24 bytes total */
+  .raw_len      = 6404096,
+
+  .cfa_pattern  = RPI_RAW_CFA_PATT_NEW,
+  .black_lvl    = BLC_OV5647,
+  .model        = "RP_OV5647",
+};
+
+const raw_fmt_t fmt_imx219 = {
+  .width        = 3280,
+  .height       = 2464,
+  .row_len      = 4128,     /* 16-pixel padding + other stuff, 28 bytes total */
+  .raw_len      = 10270208,
+
+  .cfa_pattern  = RPI_RAW_CFA_PATT_OLD,
+  .black_lvl    = BLC_IMX219,
+  .model        = "RP_imx219",
+};
+
+const raw_fmt_t *const supported_formats[] = {
+  &fmt_ov5647_old,
+  &fmt_ov5647_new,
+  &fmt_ov5647_new2,
+  &fmt_imx219,
+  NULL
+};
+
+static TIFFExtendProc parent_extender = NULL;
+
+static const TIFFFieldInfo dng_field_info[] = {
+  {TIFFTAG_OPCODELIST1,       TIFF_VARIABLE2, TIFF_VARIABLE2, TIFF_UNDEFINED, FIELD_CUSTOM, 1, 1, "OpcodeList1"},
+};
+
+
+static void tag_extender(TIFF* tif) {
+  /* Fields already known to libTIFF are left untouched */
+  TIFFMergeFieldInfo(tif, dng_field_info, sizeof(dng_field_info) / sizeof(dng_field_info[0]));
+
+  if (NULL != parent_extender) {
+    parent_extender(tif);
+  }
+}
+
+void rpiraw_register_tags(void) {
+  parent_extender = TIFFSetTagExtender(tag_extender);
+}
+
+uint64_t rpiraw_find_payload(FILE* ifp, const raw_fmt_t* fmt, bool verbose) {
+  uint64_t  offset, len;
+  uint8_t   buffer[16];
+
+  /* Check file length */
+  fseek(ifp, 0, SEEK_END);
+  len = ftell(ifp);
+  if (len <= (fmt->raw_len + 1 + 2)) {
+    if (verbose) {
+      fprintf(stderr, "File too short to contain expected %" PRIu64 "-byte RAW data.\n", fmt->raw_len);
+    }
+    return 0;
+  }
+
+  offset = (len - (fmt->raw_len + 1));
+  fseek(ifp, offset - 2, SEEK_SET);
+  if (1 != fread(buffer, 16, 1, ifp)) {
+    if (verbose) {
+      fprintf(stderr, "Cannot read RAW marker.\n");
+    }
+    return 0;
+  }
+  if ((buffer[0] != 0xff) || (buffer[1] != 0xd9)) {
+    if (verbose) {
+      fprintf(stderr, "JPEG EOI not found (want 0xffd9, got 0x%02x%02x, offset %" PRIu64 ").\n", buffer[0], buffer[1], offset);
+    }
+    return 0;
+  }
+  if (0 != strncmp((const char*)(buffer + 2), RPI_RAW_MARKER, strlen(RPI_RAW_MARKER))) {
+    if (verbose) {
+      fprintf(stderr, "RAW marker not found.\n");
+    }
+    return 0;
+  }
+
+  return offset;
+}
+
+const raw_fmt_t* rpiraw_detect(FILE* ifp, uint64_t* marker) {
+  const raw_fmt_t *const *  p_fmt   = supported_formats;
+
+  for (; NULL != *p_fmt; p_fmt ++) {
+    if (0 != (*marker = rpiraw_find_payload(ifp, *p_fmt, false))) {
+      return *p_fmt;
+    }
+  }
+
+  return NULL;
+}
+
+void rpiraw_unpack_row(const unsigned char* buffer, uint16_t* line, uint16_t width) {
+  int j, col;
+
+  j = 0; /* Offset into buffer */
+
+  /* Iterate over pixel columns (4 pixel per 5 bytes) */
+  for (col = 0; col < width; col += 4) {
+    unsigned char     split; /* 5th byte, contains 4 pairs of low-order bits */
+
+    line[col + 0]  = buffer[j ++] << 8;
+    line[col + 1]  = buffer[j ++] << 8;
+    line[col + 2]  = buffer[j ++] << 8;
+    line[col + 3]  = buffer[j ++] << 8;
+
+    /* Low-order packed bits from previous 4 pixels */
+    split           = buffer[j ++];
+    /* Unpack the bits, add to 16-bit values, left-justified */
+    line[col + 3] += (split & 0b11000000);
+    line[col + 2] += (split & 0b00110000) << 2;
+    line[col + 1] += (split & 0b00001100) << 4;
+    line[col + 0] += (split & 0b00000011) << 6;
+
+    /* Right adjust them */
+    line[col + 0] >>= (16 - RPI_RAW_BIT_DEPTH);
+    line[col + 1] >>= (16 - RPI_RAW_BIT_DEPTH);
+    line[col + 2] >>= (16 - RPI_RAW_BIT_DEPTH);
+    line[col + 3] >>= (16 - RPI_RAW_BIT_DEPTH);
+  }
+}
+
+char* rpiraw_sibling(const char* file, const char* ext) {
+  const char* base  = strrchr(file, '/');
+  const char* dot   = strrchr(file, '.');
+  char*       name;
+  size_t      len;
+
+  base = (NULL == base) ? file : (base + 1);
+  if ((NULL == dot) || (dot < base)) {
+    return NULL;
+  }
+
+  len = dot - file;
+  if (NULL == (name = (char*) malloc(len + 1 + strlen(ext) + 1))) {
+    return NULL;
+  }
+  memcpy(name, file, len);
+  sprintf(name + len, ".%s", ext);
+
+  return name;
+}
@@ -0,0 +1,77 @@
+/*
+ * Raspberry Pi "RAW" JPEG formats and helpers shared by rpi2dng and rpitrunc.
+ *
+ * The RAW payload is appended after the JPEG EOI: "@BRCM", the rest of a
+ * 32768-byte header, then rows of 10-bit packed pixels (4 pixels per 5 bytes)
+ * with some padding at the end of each row.
+ */
+
+#ifndef __RPIRAW_H__
+#define __RPIRAW_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <tiffio.h>
+
+
+#define RPI_RAW_ID_LEN          4             /* ID length, the an additional "@" not counted */
+#define RPI_RAW_MARKER          "@BRCM"       /* Marker + ID */
+#define RPI_RAW_HDR_LEN         32768         /* RAW header length */
+#define RPI_RAW_BIT_DEPTH       10            /* Always 10-bit packed for now, will need new unpacking procedure when 12-bit present */
+#define RPI_RAW_MAX_MODEL_LEN   9
+
+#define TIFF_CFA_R              0
+#define TIFF_CFA_G              1
+#define TIFF_CFA_B              2
+#define TIFF_CFA_C              3
+#define TIFF_CFA_M              4
+#define TIFF_CFA_Y              5
+#define TIFF_CFA_K              6             /* White (clear) pixel */
+
+#define RPI_RAW_CFA_FLIP_NONE   0x00
+#define RPI_RAW_CFA_FLIP_HORIZ  0x01
+#define RPI_RAW_CFA_FLIP_VERT   0x02
+#define RPI_RAW_CFA_FLIP_BOTH   (RPI_RAW_CFA_FLIP_HORIZ | RPI_RAW_CFA_FLIP_VERT)
+#define RPI_RAW_CFA_PATT_NEW    {TIFF_CFA_G, TIFF_CFA_B, TIFF_CFA_R, TIFF_CFA_G}
+#define RPI_RAW_CFA_PATT_OLD    {TIFF_CFA_B, TIFF_CFA_G, TIFF_CFA_G, TIFF_CFA_R}
+
+#define BLC_OV5647              {16, 16, 16, 16}
+#define BLC_IMX219              {64, 64, 64, 64} /* Nearly universal on SONY CIS */
+
+#ifndef MIN                                   /* Also defined by <libexif/exif-data.h> */
+#define MIN(a, b)               (((a) < (b)) ? (a) : (b))
+#define MAX(a, b)               (((a) > (b)) ? (a) : (b))
+#endif
+
+#ifndef TIFFTAG_OPCODELIST1
+#define TIFFTAG_OPCODELIST1     51008         /* Not known to older libTIFF */
+#endif
+
+
+typedef struct {
+  uint16_t  width;
+  uint16_t  height;
+  uint16_t  row_len;
+  uint64_t  raw_len;
+
+  char      cfa_pattern[4];
+  float     black_lvl[4];
+  char      model[RPI_RAW_MAX_MODEL_LEN + 1];
+} raw_fmt_t;
+
+
+extern const raw_fmt_t *const supported_formats[];
+
+
+/* Offset of the RAW marker, i.e. where the JPEG ends, 0 if `fmt' does not match */
+uint64_t rpiraw_find_payload(FILE* ifp, const raw_fmt_t* fmt, bool verbose);
+/* Find the format by payload length alone (model names differ, layouts do not) */
+const raw_fmt_t* rpiraw_detect(FILE* ifp, uint64_t* marker);
+void rpiraw_unpack_row(const unsigned char* buffer, uint16_t* line, uint16_t width);
+/* Name of the file next to `file' with its extension replaced by `ext' (malloc'ed), NULL if `file' has none */
+char* rpiraw_sibling(const char* file, const char* ext);
+/* Make libTIFF aware of the DNG tags used here, call before TIFFOpen() */
+void rpiraw_register_tags(void);
+
+#endif /* __RPIRAW_H__ */
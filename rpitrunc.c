@@ -1,84 +1,386 @@
-/* Removes padded RAW data from JPEG. Use with caution. Currently for OV5647 only. */
+/*
+ * Removes padded RAW data from Raspberry Pi "RAW" JPEGs, for all formats
+ * known to rpi2dng. Files are processed in parallel and without asking, so
+ * use -n first and -d when the RAW data is only kept in DNGs.
+ *
+ * Truncation is the last step for each file: the sidecar (if any) is synced
+ * and renamed into place, and the DNG (if verified) is synced before the JPEG
+ * is cut, so a crash never loses the only copy of the RAW data.
+ */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <tiffio.h>
 
-#define RPI_OV5647_RAW_RAW_LEN 6404096
-#define RPI_OV5647_RAW_MARKER  "@BRCM"
+#include "rpiraw.h"
 
-static void process_file(char* file) {
-  FILE*   ifp     = NULL;
-  size_t  len;  // number of bytes in file
-  ssize_t offset;  // offset into file to start reading pixel data
-  uint8_t buffer[16];
 
-  /* Check file existence */
-  if (NULL == (ifp = fopen(file, "rb"))) {
+#define RPI_MAX_THREADS         64            /* Mostly waiting for I/O */
+#define SIDECAR_EXT             "raw"         /* RAW payload as captured, header included */
+#define DNG_EXT                 "dng"
+
+#define RESULT_DONE             0
+#define RESULT_SKIPPED          1
+#define RESULT_FAILED           2
+
+
+typedef struct {
+  bool              dry_run;
+  bool              verify;
+  bool              sidecar;
+} trunc_opts_t;
+
+typedef struct {
+  const trunc_opts_t* opts;
+  char**            files;
+  int               count;
+
+  pthread_mutex_t   lock;
+  int               next;       /* Next file to process */
+  int               result[3];  /* Number of files for each RESULT_* */
+} trunc_ctx_t;
+
+
+static void usage(const char* self) {
+  fprintf (stderr, "Usage: %s [options] infile1.jpg [infile2.jpg ...]\n\n"
+    "Options:\n"
+      "\t-n          Dry run, only report what would be done\n"
+      "\t-d          Only truncate when the matching DNG exists and holds exactly the RAW\n"
+      "\t            data of the file\n"
+      "\t-s          Save the RAW data to a sidecar file (.%s) instead of discarding it\n"
+      "\t-j threads  Process this many files at a time (default: number of CPUs)\n",
+    self, SIDECAR_EXT);
+  exit(EXIT_FAILURE);
+}
+
+static int sync_dir(const char* file) {
+  char* copy;
+  int   fd, ret = -1;
+
+  if (NULL == (copy = strdup(file))) {
+    return -1;
+  }
+  if ((fd = open(dirname(copy), O_RDONLY | O_DIRECTORY)) >= 0) {
+    ret = fsync(fd);
+    close(fd);
+  }
+  free(copy);
+
+  return ret;
+}
+
+/* Check that `dng' holds exactly the RAW data in `ifp', and make sure it is on disk */
+static bool verify_dng(const char* file, const char* dng, FILE* ifp, uint64_t marker, const raw_fmt_t* fmt) {
+  TIFF*           tif     = NULL;
+  uint32_t        width = 0, height = 0, strip, row = 0, col = 0;
+  uint16_t        bits = 0;
+  uint16_t*       buffer  = NULL;
+  unsigned char*  packed  = NULL;
+  uint16_t*       line    = NULL;
+  tmsize_t        size, len, i, n;
+  bool            ok      = false;
+  int             fd;
+
+  if (NULL == (tif = TIFFOpen(dng, "r"))) {
+    fprintf(stderr, "`%s': cannot open `%s'.\n", file, dng);
+    return false;
+  }
+
+  TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+  TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+  TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+  if ((width != fmt->width) || (height != fmt->height) || (16 != bits)) {
+    fprintf(stderr, "`%s': `%s' is %" PRIu32 "x%" PRIu32 " %" PRIu16 "-bit, not from this file.\n", file, dng, width, height, bits);
+    goto fail;
+  }
+
+  size    = TIFFStripSize(tif);
+  buffer  = (uint16_t*) malloc(size);
+  packed  = (unsigned char*) malloc(fmt->row_len);
+  line    = (uint16_t*) malloc(fmt->width * sizeof(line[0]));
+  if ((NULL == buffer) || (NULL == packed) || (NULL == line)) {
+    fprintf(stderr, "`%s': cannot allocate memory.\n", file);
+    goto fail;
+  }
+
+  /* Whatever the strip layout, samples come in row-scan order, compare them with the RAW data as unpacked by rpi2dng */
+  for (strip = 0; strip < TIFFNumberOfStrips(tif); strip ++) {
+    if ((len = TIFFReadEncodedStrip(tif, strip, buffer, size)) < 0) {
+      fprintf(stderr, "`%s': cannot read `%s'.\n", file, dng);
+      goto fail;
+    }
+    len /= sizeof(buffer[0]);
+
+    for (i = 0; i < len; i += n) {
+      if (0 == col) {
+        if (row == fmt->height) {
+          break;
+        }
+        if ((ssize_t)fmt->row_len != pread(fileno(ifp), packed, fmt->row_len, marker + 1 + RPI_RAW_HDR_LEN + (uint64_t)row * fmt->row_len)) {
+          fprintf(stderr, "`%s': cannot read RAW data.\n", file);
+          goto fail;
+        }
+        rpiraw_unpack_row(packed, line, fmt->width);
+      }
+
+      n = MIN(len - i, (tmsize_t)(fmt->width - col));
+      if (0 != memcmp(buffer + i, line + col, n * sizeof(buffer[0]))) {
+        break;
+      }
+      col += n;
+      if (col == fmt->width) {
+        col = 0;
+        row ++;
+      }
+    }
+    if (i < len) {
+      break;
+    }
+  }
+  if ((row != fmt->height) || (0 != col) || (strip != TIFFNumberOfStrips(tif))) {
+    fprintf(stderr, "`%s': `%s' does not hold the RAW data of this file (or is corrupted).\n", file, dng);
+    goto fail;
+  }
+
+  /* It is about to become the only copy */
+  if (((fd = open(dng, O_RDONLY)) < 0) || (0 != fsync(fd))) {
+    perror(dng);
+    if (fd >= 0) {
+      close(fd);
+    }
+    goto fail;
+  }
+  close(fd);
+  if (0 != sync_dir(dng)) {
+    perror(dng);
+    goto fail;
+  }
+
+  ok = true;
+
+fail:
+  free(buffer);
+  free(packed);
+  free(line);
+
+  TIFFClose(tif);
+
+  return ok;
+}
+
+/* Copy the payload (without "@") to `sidecar', atomically and durably */
+static bool save_sidecar(const char* file, const char* sidecar, FILE* ifp, uint64_t marker, const raw_fmt_t* fmt) {
+  char      tmp[PATH_MAX];
+  char      buffer[65536];
+  uint64_t  done;
+  ssize_t   len;
+  int       fd;
+  bool      renamed = false;
+  bool      ok      = false;
+
+  if ((size_t)snprintf(tmp, sizeof(tmp), "%s.XXXXXX", sidecar) >= sizeof(tmp)) {
+    fprintf(stderr, "`%s': path too long.\n", file);
+    return false;
+  }
+  if ((fd = mkstemp(tmp)) < 0) {
+    perror(tmp);
+    return false;
+  }
+
+  for (done = 0; done < fmt->raw_len; done += len) {
+    len = pread(fileno(ifp), buffer, MIN(sizeof(buffer), fmt->raw_len - done), marker + 1 + done);
+    if (len <= 0) {
+      fprintf(stderr, "`%s': cannot read RAW data.\n", file);
+      goto fail;
+    }
+    if (len != write(fd, buffer, len)) {
+      perror(tmp);
+      goto fail;
+    }
+  }
+
+  if ((0 != fsync(fd)) || (0 != fchmod(fd, 0644))) {
+    perror(tmp);
+    goto fail;
+  }
+  if (0 != rename(tmp, sidecar)) {
+    perror(sidecar);
+    goto fail;
+  }
+  renamed = true;
+  /* Otherwise the sidecar may be gone after a crash, while the JPEG is cut */
+  if (0 != sync_dir(sidecar)) {
+    perror(sidecar);
+    goto fail;
+  }
+  ok = true;
+
+fail:
+  close(fd);
+  if (!renamed) {
+    unlink(tmp);
+  }
+
+  return ok;
+}
+
+static int process_file(const char* file, const trunc_opts_t* opts) {
+  FILE*             ifp     = NULL;
+  char*             dng     = NULL;
+  char*             sidecar = NULL;
+  const raw_fmt_t*  fmt;
+  uint64_t          marker;
+  int               ret     = RESULT_FAILED;
+
+  /* Open once and keep using the same file, whatever happens to the name */
+  if (NULL == (ifp = fopen(file, opts->dry_run ? "rb" : "r+b"))) {
     perror(file);
-    return;
+    goto fail;
   }
 
-  /* Check file length */
-  fseek(ifp, 0, SEEK_END);
-  len = ftell(ifp);
-  if (len < RPI_OV5647_RAW_RAW_LEN) {
-    fprintf(stderr, "File is too short to contain expected 6MB RAW data.\n");
+  if (NULL == (fmt = rpiraw_detect(ifp, &marker))) {
+    fprintf(stderr, "`%s': no RAW data found, skipped.\n", file);
+    ret = RESULT_SKIPPED;
     goto fail;
   }
 
-  /* Location in file where RAW padding starts */
-  offset = (len - RPI_OV5647_RAW_RAW_LEN - 1);
-  fseek(ifp, offset - 2, SEEK_SET);
-  fread(buffer, 16, 1, ifp);
-  if ((buffer[0] != 0xff) || (buffer[1] != 0xd9)) {
-    fprintf(stderr, "JPEG EOI not found (want 0xffd9, got 0x%02x%02x).\n", buffer[0], buffer[1]);
+  if (opts->verify) {
+    if ((NULL == (dng = rpiraw_sibling(file, DNG_EXT))) || !verify_dng(file, dng, ifp, marker, fmt)) {
+      fprintf(stderr, "`%s': not verified, skipped.\n", file);
+      ret = RESULT_SKIPPED;
+      goto fail;
+    }
+  }
+
+  if (opts->dry_run) {
+    fprintf(stderr, "`%s': would remove %" PRIu64 " bytes of %s RAW data.\n", file, fmt->raw_len + 1, fmt->model);
+    ret = RESULT_DONE;
     goto fail;
   }
-  if (0 != strncmp((const char*)(buffer + 2), RPI_OV5647_RAW_MARKER, 5)) {
-    fprintf(stderr, "RAW marker not found.\n");
+
+  if (opts->sidecar) {
+    if ((NULL == (sidecar = rpiraw_sibling(file, SIDECAR_EXT))) || !save_sidecar(file, sidecar, ifp, marker, fmt)) {
+      goto fail;
+    }
+  }
+
+  if ((0 != ftruncate(fileno(ifp), marker)) || (0 != fsync(fileno(ifp)))) {
+    perror(file);
     goto fail;
   }
 
-  fclose(ifp);
-  ifp = NULL;
-  truncate(file, offset);
+  fprintf(stderr, "`%s': removed %" PRIu64 " bytes of %s RAW data%s.\n", file, fmt->raw_len + 1, fmt->model, opts->sidecar ? " (saved to sidecar)" : "");
+  ret = RESULT_DONE;
 
 fail:
   if (NULL != ifp) {
     fclose(ifp);
   }
 
-  return;
+  free(dng);
+  free(sidecar);
+
+  return ret;
+}
+
+static void* worker(void* arg) {
+  trunc_ctx_t*  ctx = (trunc_ctx_t*) arg;
+  int           i, ret;
+
+  for (;;) {
+    pthread_mutex_lock(&ctx->lock);
+    i = ctx->next ++;
+    pthread_mutex_unlock(&ctx->lock);
+    if (i >= ctx->count) {
+      break;
+    }
+
+    ret = process_file(ctx->files[i], ctx->opts);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->result[ret] ++;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  return NULL;
 }
 
 int main(int argc, char* argv[]) {
-  int i;
-  char c;
+  trunc_opts_t  opts    = {0};
+  trunc_ctx_t   ctx;
+  pthread_t     tid[RPI_MAX_THREADS];
+  int           threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int           started, opt;
 
-  if (argc < 2) {
-    return EXIT_FAILURE;
+  /* Scan options */
+  while ((opt = getopt(argc, argv, ":ndsj:")) != -1) {
+    switch (opt) {
+    case 'n': {
+      opts.dry_run = true;
+      break;
+    }
+    case 'd': {
+      opts.verify  = true;
+      break;
+    }
+    case 's': {
+      opts.sidecar = true;
+      break;
+    }
+    case 'j': {
+      threads      = atoi(optarg);
+      if (threads < 1) {
+        usage(argv[0]);
+      }
+      break;
+    }
+    default: /* '?' */
+      usage(argv[0]);
+    }
   }
 
-  fprintf(stderr, "File involved:\n");
-  for (i = 1; i < argc; i ++) {
-    fprintf(stderr, "\t%s\n", argv[i]);
+  /* Expect at least one input-filename */
+  if (optind >= argc) {
+    usage(argv[0]);
   }
 
-  fprintf(stderr, "Continue[y/N]? ");
-  c = getchar();
-  if (c != 'y' && c != 'Y') {
-    fprintf(stderr, "Canceled.\n");
-    return EXIT_FAILURE;
+  /* DNGs may carry tags unknown to libTIFF (e.g. OpcodeList1 with rpi2dng -B) */
+  if (opts.verify) {
+    rpiraw_register_tags();
   }
 
-  for (i = 1; i < argc; i ++) {
-    fprintf(stderr, "`%s':\n", argv[i]);
-    process_file(argv[i]);
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.opts  = &opts;
+  ctx.files = argv + optind;
+  ctx.count = argc - optind;
+  pthread_mutex_init(&ctx.lock, NULL);
+
+  threads = MAX(1, MIN(MIN(threads, RPI_MAX_THREADS), ctx.count));
+  for (started = 0; started < threads; started ++) {
+    if (0 != pthread_create(&tid[started], NULL, worker, &ctx)) {
+      break;
+    }
+  }
+  if (0 == started) {
+    /* Do it here then */
+    worker(&ctx);
   }
+  while (started > 0) {
+    pthread_join(tid[-- started], NULL);
+  }
+
+  fprintf(stderr, "%d file(s) %s, %d skipped, %d failed.\n", ctx.result[RESULT_DONE], opts.dry_run ? "to truncate" : "truncated",
+          ctx.result[RESULT_SKIPPED], ctx.result[RESULT_FAILED]);
 
-  return EXIT_SUCCESS;
+  return (0 == ctx.result[RESULT_FAILED]) ? EXIT_SUCCESS : EXIT_FAILURE;
 }